@@ -79,12 +79,12 @@ void receiver(void *pvParameters)
 		Nrf24_getData(&dev, buf);
 	}
 
+	rf24_packet_t packets[3];
 	while(1) {
-		// Wait for received data
-		if (Nrf24_dataReady(&dev)) {
-			uint8_t pipe = Nrf24_getDataPipe(&dev);
-			Nrf24_getData(&dev, buf);
-			ESP_LOGI(pcTaskGetName(NULL), "Got data pipe(%d):%s", pipe, buf);
+		// Read every payload waiting in the RX FIFO
+		uint8_t count = Nrf24_drainRx(&dev, packets, 3);
+		for (int i=0;i<count;i++) {
+			ESP_LOGI(pcTaskGetName(NULL), "Got data pipe(%d):%.*s", packets[i].pipe, packets[i].length, packets[i].data);
 		}
 		vTaskDelay(1);
 	}
@@ -1,4 +1,5 @@
 #include <string.h>
+#include <inttypes.h>
 
 #include "freertos/FreeRTOS.h"
 #include "freertos/task.h"
@@ -6,8 +7,12 @@
 #include <driver/spi_master.h>
 #include <driver/gpio.h>
 #include "esp_log.h"
+#include "esp_timer.h"
+#include "esp_heap_caps.h"
 
 #include "mirf.h"
+#include "mirf_dedup.h"
+#include "mirf_stats.h"
 
 #define TAG "NRF24"
 
@@ -18,10 +23,22 @@
 #define HOST_ID SPI3_HOST
 #endif
 
-static const int SPI_Frequency = 4000000; // Stable even with a long jumper cable
-//static const int SPI_Frequency = 6000000;
-//static const int SPI_Frequency = 8000000; // Requires a short jumper cable
-//static const int SPI_Frequency = 10000000; // Unstable even with a short jumper cable
+// 4MHz is stable even with a long jumper cable, 8MHz requires a short one.
+// Nrf24_trainClock finds the fastest clock the wiring allows.
+static const int SPI_Frequency = CONFIG_SPI_FREQUENCY;
+
+// Clock steps tried by Nrf24_trainClock. The SPI clock is divided from 80MHz.
+static const int SPI_TrainSteps[] = { 4000000, 5000000, 6666666, 8000000, 10000000 };
+#define SPI_TRAIN_ROUNDS 16
+
+// Longest a packet can hold the TX FIFO: 15 retransmits at ARD 4000us
+#define TX_FULL_TIMEOUT 100 // ms
+
+// Services in a row while IRQ stays low
+#define IRQ_MAX_ROUNDS 8
+
+// An asynchronous packet without TX_DS or MAX_RT by then is given up
+#define ASYNC_TIMEOUT 100 // ms
 
 //const char rf24_datarates[][8] = {"1Mbps", "2Mbps", "250Kbps"};
 char rf24_datarates[][8] = {"1Mbps", "2Mbps", "250Kbps"};
@@ -29,64 +46,248 @@ const char rf24_crclength[][10] = {"Disabled", "8 bits", "16 bits"};
 //const char rf24_pa_dbm[][8] = {"PA_MIN", "PA_LOW", "PA_HIGH", "PA_MAX"};
 char rf24_pa_dbm[][8] = {"PA_MIN", "PA_LOW", "PA_HIGH", "PA_MAX"};
 
-void Nrf24_init(NRF24_t * dev)
-{
-	esp_err_t ret;
+// Registers that only change when written by the host and are kept in dev->regs:
+// CONFIG..RF_SETUP, RX_ADDR_P2..RX_ADDR_P5, RX_PW_P0..RX_PW_P5, DYNPD, FEATURE
+#define SHADOW_MASK 0x307EF07FUL
 
-	ESP_LOGI(TAG, "CONFIG_MISO_GPIO=%d", CONFIG_MISO_GPIO);
-	ESP_LOGI(TAG, "CONFIG_MOSI_GPIO=%d", CONFIG_MOSI_GPIO);
-	ESP_LOGI(TAG, "CONFIG_SCLK_GPIO=%d", CONFIG_SCLK_GPIO);
-	ESP_LOGI(TAG, "CONFIG_CE_GPIO=%d", CONFIG_CE_GPIO);
-	ESP_LOGI(TAG, "CONFIG_CSN_GPIO=%d", CONFIG_CSN_GPIO);
+static bool isShadowed(uint8_t reg)
+{
+	return (reg < 32) && (SHADOW_MASK & (1UL << reg));
+}
 
-	//gpio_pad_select_gpio(CONFIG_CE_GPIO);
-	gpio_reset_pin(CONFIG_CE_GPIO);
-	gpio_set_direction(CONFIG_CE_GPIO, GPIO_MODE_OUTPUT);
-	gpio_set_level(CONFIG_CE_GPIO, 0);
+// Shadow copy of the multi-byte address registers
+static uint8_t * shadowAddr(NRF24_t * dev, uint8_t reg)
+{
+	if (reg == RX_ADDR_P0) return dev->addr[0];
+	if (reg == RX_ADDR_P1) return dev->addr[1];
+	if (reg == TX_ADDR) return dev->addr[2];
+	return NULL;
+}
 
-	//gpio_pad_select_gpio(CONFIG_CSN_GPIO);
-	gpio_reset_pin(CONFIG_CSN_GPIO);
-	gpio_set_direction(CONFIG_CSN_GPIO, GPIO_MODE_OUTPUT);
-	gpio_set_level(CONFIG_CSN_GPIO, 1);
+// Devices on each SPI host. The bus is initialized by the first device and
+// freed with the last one, unless it was initialized outside this driver.
+static int busUsers[SPI_HOST_MAX];
+static bool busOwned[SPI_HOST_MAX];
+static SemaphoreHandle_t busMutex;
+static portMUX_TYPE busMux = portMUX_INITIALIZER_UNLOCKED;
 
-	spi_bus_config_t spi_bus_config = {
-		.sclk_io_num = CONFIG_SCLK_GPIO,
-		.mosi_io_num = CONFIG_MOSI_GPIO,
-		.miso_io_num = CONFIG_MISO_GPIO,
-		.quadwp_io_num = -1,
-		.quadhd_io_num = -1
-	};
+static void Nrf24_lockBusTable(void)
+{
+	if (busMutex == NULL) {
+		SemaphoreHandle_t mutex = xSemaphoreCreateMutex();
+		portENTER_CRITICAL(&busMux);
+		if (busMutex == NULL) {
+			busMutex = mutex;
+			mutex = NULL;
+		}
+		portEXIT_CRITICAL(&busMux);
+		if (mutex) vSemaphoreDelete(mutex);
+	}
+	xSemaphoreTake(busMutex, portMAX_DELAY);
+}
 
-	ret = spi_bus_initialize( HOST_ID, &spi_bus_config, SPI_DMA_CH_AUTO );
-	ESP_LOGI(TAG, "spi_bus_initialize=%d",ret);
-	assert(ret==ESP_OK);
+static void Nrf24_unlockBusTable(void)
+{
+	xSemaphoreGive(busMutex);
+}
 
+// Adds dev to its SPI host with the given clock
+static esp_err_t spi_add_device(NRF24_t * dev, int clockSpeed)
+{
 	spi_device_interface_config_t devcfg;
 	memset( &devcfg, 0, sizeof( spi_device_interface_config_t ) );
-	devcfg.clock_speed_hz = SPI_Frequency;
-	// It does not work with hardware CS control.
-	//devcfg.spics_io_num = csn_pin;
-	// It does work with software CS control.
-	devcfg.spics_io_num = -1;
-	devcfg.queue_size = 7;
+	devcfg.clock_speed_hz = clockSpeed;
+	if (dev->csnHw) {
+		// Every command is a single transaction, so the SPI peripheral can frame it with CSN.
+		devcfg.spics_io_num = dev->csnPin;
+	} else {
+		// Software CS control.
+		devcfg.spics_io_num = -1;
+	}
+	devcfg.queue_size = dev->queueSize;
 	devcfg.mode = 0;
 	devcfg.flags = SPI_DEVICE_NO_DUMMY;
 
 	spi_device_handle_t handle;
-	ret = spi_bus_add_device( HOST_ID, &devcfg, &handle);
-	ESP_LOGI(TAG, "spi_bus_add_device=%d",ret);
+	esp_err_t ret = spi_bus_add_device( dev->host, &devcfg, &handle);
+	if (ret != ESP_OK) return ret;
+	dev->_SPIHandle = handle;
+	dev->clockSpeed = clockSpeed;
+	return ESP_OK;
+}
+
+// Fills config with the pins, host and options selected in menuconfig
+void Nrf24_getDefaultConfig(NRF24_config_t * config)
+{
+	memset(config, 0, sizeof(NRF24_config_t));
+	config->misoPin = CONFIG_MISO_GPIO;
+	config->mosiPin = CONFIG_MOSI_GPIO;
+	config->sclkPin = CONFIG_SCLK_GPIO;
+	config->cePin = CONFIG_CE_GPIO;
+	config->csnPin = CONFIG_CSN_GPIO;
+	config->host = HOST_ID;
+	config->clockSpeed = SPI_Frequency;
+	config->queueSize = 7;
+#if CONFIG_CSN_HW
+	config->csnHw = true;
+#else
+	config->csnHw = false;
+#endif
+#if CONFIG_SPI_POLLING
+	config->polling = true;
+#else
+	config->polling = false;
+#endif
+}
+
+void Nrf24_init(NRF24_t * dev)
+{
+	NRF24_config_t config;
+	Nrf24_getDefaultConfig(&config);
+	esp_err_t ret = Nrf24_initWithConfig(dev, &config);
 	assert(ret==ESP_OK);
+}
+
+// Initializes a device with its own pins and SPI host.
+// Several devices may share one host; the bus pins of the first one are used then.
+esp_err_t Nrf24_initWithConfig(NRF24_t * dev, const NRF24_config_t * config)
+{
+	esp_err_t ret;
+
+	ESP_LOGI(TAG, "MISO_GPIO=%d", config->misoPin);
+	ESP_LOGI(TAG, "MOSI_GPIO=%d", config->mosiPin);
+	ESP_LOGI(TAG, "SCLK_GPIO=%d", config->sclkPin);
+	ESP_LOGI(TAG, "CE_GPIO=%d", config->cePin);
+	ESP_LOGI(TAG, "CSN_GPIO=%d", config->csnPin);
+	if (config->host >= SPI_HOST_MAX) return ESP_ERR_INVALID_ARG;
+
+	// Word aligned DMA buffers, so that the SPI driver does not bounce-copy every command
+	dev->dmaTx = heap_caps_malloc(MIRF_SLOT_SIZE, MALLOC_CAP_DMA);
+	dev->dmaRx = heap_caps_malloc(MIRF_SLOT_SIZE, MALLOC_CAP_DMA);
+	if (dev->dmaTx == NULL || dev->dmaRx == NULL) {
+		heap_caps_free(dev->dmaTx);
+		heap_caps_free(dev->dmaRx);
+		return ESP_ERR_NO_MEM;
+	}
+
+	//gpio_pad_select_gpio(config->cePin);
+	gpio_reset_pin(config->cePin);
+	gpio_set_direction(config->cePin, GPIO_MODE_OUTPUT);
+	gpio_set_level(config->cePin, 0);
+
+	if (!config->csnHw) {
+		//gpio_pad_select_gpio(config->csnPin);
+		gpio_reset_pin(config->csnPin);
+		gpio_set_direction(config->csnPin, GPIO_MODE_OUTPUT);
+		gpio_set_level(config->csnPin, 1);
+	}
+
+	spi_bus_config_t spi_bus_config = {
+		.sclk_io_num = config->sclkPin,
+		.mosi_io_num = config->mosiPin,
+		.miso_io_num = config->misoPin,
+		.quadwp_io_num = -1,
+		.quadhd_io_num = -1
+	};
+
+	Nrf24_lockBusTable();
+	if (busUsers[config->host] == 0) {
+		ret = spi_bus_initialize( config->host, &spi_bus_config, SPI_DMA_CH_AUTO );
+		ESP_LOGI(TAG, "spi_bus_initialize=%d",ret);
+		// ESP_ERR_INVALID_STATE: the application owns the bus
+		if (ret != ESP_OK && ret != ESP_ERR_INVALID_STATE) {
+			Nrf24_unlockBusTable();
+			heap_caps_free(dev->dmaTx);
+			heap_caps_free(dev->dmaRx);
+			return ret;
+		}
+		busOwned[config->host] = (ret == ESP_OK);
+	}
 
-	dev->cePin = CONFIG_CE_GPIO;
-	dev->csnPin = CONFIG_CSN_GPIO;
+	dev->cePin = config->cePin;
+	dev->csnPin = config->csnPin;
 	dev->channel = 1;
 	dev->payload = 16;
-	dev->_SPIHandle = handle;
+	dev->_SPIHandle = NULL;
+	dev->host = config->host;
+	dev->clockSpeed = config->clockSpeed;
+	dev->queueSize = config->queueSize;
+	dev->polling = config->polling;
+	dev->csnHw = config->csnHw;
+
+	ret = spi_add_device(dev, config->clockSpeed);
+	ESP_LOGI(TAG, "spi_bus_add_device=%d",ret);
+	if (ret != ESP_OK) {
+		if (busUsers[config->host] == 0 && busOwned[config->host]) spi_bus_free(config->host);
+		Nrf24_unlockBusTable();
+		heap_caps_free(dev->dmaTx);
+		heap_caps_free(dev->dmaRx);
+		return ret;
+	}
+	busUsers[config->host]++;
+	Nrf24_unlockBusTable();
+
+	dev->busDepth = 0;
+	dev->ackTx = false;
+	dev->status = 0;
+	dev->statusTime = 0;
+	dev->streaming = false;
+	dev->config = mirf_CONFIG;
+	dev->lock = NULL;
+	dev->irqPin = -1;
+	dev->irqTask = NULL;
+	dev->irqStop = false;
+	dev->rxQueue = NULL;
+	dev->txQueue = NULL;
+	dev->irqTime = 0;
+	dev->rxDropped = 0;
+	dev->asyncQueue = NULL;
+	dev->txReports = NULL;
+	dev->txCallback = NULL;
+	dev->txCallbackArg = NULL;
+	dev->asyncNext = 1;
+	dev->asyncHandle = 0;
+	dev->asyncDeadline = 0;
+	dev->poolBase = NULL;
+	dev->poolCount = 0;
+	dev->poolFree = NULL;
+	dev->dedup = NULL;
+	dev->stats = NULL;
+	dev->txStart = 0;
+
+	// nRF24L01 keeps its settings until power cycled, so start from what is in the chip
+	Nrf24_syncRegisters(dev);
+	return ESP_OK;
 }
 
+// Removes the device; the SPI bus is freed together with its last device
 void Nrf24_deinit(NRF24_t *dev) {
+	Nrf24_disableIrq(dev);
+	Nrf24_deletePool(dev);
+	while (dev->busDepth) Nrf24_releaseBus(dev);
+	spi_host_device_t host = dev->host;
+	Nrf24_lockBusTable();
+	if (dev->_SPIHandle) {
+		spi_bus_remove_device(dev->_SPIHandle);
+		if (--busUsers[host] == 0 && busOwned[host]) {
+			spi_bus_free(host);
+			busOwned[host] = false;
+		}
+	}
+	Nrf24_unlockBusTable();
+	heap_caps_free(dev->dmaTx);
+	heap_caps_free(dev->dmaRx);
 	memset(dev, 0, sizeof(NRF24_t));
-	spi_bus_free(HOST_ID);
+}
+
+// nRF24 transfers are at most 33 bytes, so with polling enabled they are
+// busy-waited instead of going through the interrupt driven queue.
+static esp_err_t spi_transmit(NRF24_t * dev, spi_transaction_t * trans)
+{
+	// The device can only be missing after a failed Nrf24_setClockSpeed
+	if (dev->_SPIHandle == NULL) return ESP_ERR_INVALID_STATE;
+	if (dev->polling) return spi_device_polling_transmit( dev->_SPIHandle, trans );
+	return spi_device_transmit( dev->_SPIHandle, trans );
 }
 
 bool spi_write_byte(NRF24_t * dev, uint8_t* Dataout, size_t DataLength )
@@ -98,7 +299,7 @@ bool spi_write_byte(NRF24_t * dev, uint8_t* Dataout, size_t DataLength )
 		SPITransaction.length = DataLength * 8;
 		SPITransaction.tx_buffer = Dataout;
 		SPITransaction.rx_buffer = NULL;
-		spi_device_transmit( dev->_SPIHandle, &SPITransaction );
+		spi_transmit( dev, &SPITransaction );
 	}
 
 	return true;
@@ -113,12 +314,144 @@ bool spi_read_byte(NRF24_t * dev, uint8_t* Datain, uint8_t* Dataout, size_t Data
 		SPITransaction.length = DataLength * 8;
 		SPITransaction.tx_buffer = Dataout;
 		SPITransaction.rx_buffer = Datain;
-		spi_device_transmit( dev->_SPIHandle, &SPITransaction );
+		spi_transmit( dev, &SPITransaction );
 	}
 
 	return true;
 }
 
+// Chip access is only shared with the IRQ task, so the lock exists only while it runs
+static void Nrf24_lock(NRF24_t * dev)
+{
+	if (dev->lock) xSemaphoreTakeRecursive(dev->lock, portMAX_DELAY);
+}
+
+static void Nrf24_unlock(NRF24_t * dev)
+{
+	if (dev->lock) xSemaphoreGiveRecursive(dev->lock);
+}
+
+// Allocates count payload slots in DMA capable memory.
+// Each slot holds a command byte followed by up to 32 payload bytes, so a
+// payload lent with Nrf24_allocPayload is sent and received without copies.
+esp_err_t Nrf24_createPool(NRF24_t * dev, uint16_t count)
+{
+	if (dev->poolBase) return ESP_ERR_INVALID_STATE;
+	if (count == 0) return ESP_ERR_INVALID_ARG;
+	dev->poolBase = heap_caps_malloc(MIRF_SLOT_SIZE * count, MALLOC_CAP_DMA);
+	dev->poolFree = xQueueCreate(count, sizeof(uint8_t *));
+	if (dev->poolBase == NULL || dev->poolFree == NULL) {
+		dev->poolCount = 0;
+		Nrf24_deletePool(dev);
+		return ESP_ERR_NO_MEM;
+	}
+	dev->poolCount = count;
+	for (int i=0;i<count;i++) {
+		uint8_t * payload = dev->poolBase + i * MIRF_SLOT_SIZE + 1;
+		xQueueSend(dev->poolFree, &payload, 0);
+	}
+	return ESP_OK;
+}
+
+// Frees the pool. Every payload must have been returned.
+void Nrf24_deletePool(NRF24_t * dev)
+{
+	if (dev->poolFree) vQueueDelete(dev->poolFree);
+	heap_caps_free(dev->poolBase);
+	dev->poolFree = NULL;
+	dev->poolBase = NULL;
+	dev->poolCount = 0;
+}
+
+bool Nrf24_isPoolPayload(NRF24_t * dev, const uint8_t * payload)
+{
+	if (dev->poolBase == NULL || payload <= dev->poolBase) return false;
+	size_t offset = payload - dev->poolBase;
+	return offset < (size_t)dev->poolCount * MIRF_SLOT_SIZE && (offset % MIRF_SLOT_SIZE) == 1;
+}
+
+// Lends a 32 byte payload buffer, waiting up to timeout ms for one to be returned.
+// Returns NULL when the pool is empty.
+uint8_t * Nrf24_allocPayload(NRF24_t * dev, int timeout)
+{
+	uint8_t * payload = NULL;
+	if (dev->poolFree == NULL) return NULL;
+	if (xQueueReceive(dev->poolFree, &payload, pdMS_TO_TICKS(timeout)) != pdTRUE) return NULL;
+	return payload;
+}
+
+// Returns a payload buffer lent by Nrf24_allocPayload or Nrf24_receivePayload
+void Nrf24_freePayload(NRF24_t * dev, uint8_t * payload)
+{
+	if (!Nrf24_isPoolPayload(dev, payload)) return;
+	xQueueSend(dev->poolFree, &payload, 0);
+}
+
+// Clocks a command byte followed by len data bytes in a single SPI transaction.
+// dataout may be NULL, in which case NOPs are clocked out after the command.
+// datain may be NULL when the data shifted out by the chip is not needed.
+// Returns the STATUS byte the chip shifts out while the command is clocked in.
+// Payloads lent from the pool (Nrf24_allocPayload) are clocked out of and into their slot directly.
+uint8_t Nrf24_command(NRF24_t * dev, uint8_t cmd, const uint8_t * dataout, uint8_t * datain, uint8_t len)
+{
+	spi_transaction_t SPITransaction;
+	const uint8_t * rx;
+
+	if (len > mirf_MAX_PAYLOAD) len = mirf_MAX_PAYLOAD;
+	memset( &SPITransaction, 0, sizeof( spi_transaction_t ) );
+	SPITransaction.length = (len + 1) * 8;
+	Nrf24_lock(dev);
+	if (len < 4) {
+		// Short commands fit into the transaction itself and need no DMA buffer
+		SPITransaction.flags = SPI_TRANS_USE_TXDATA | SPI_TRANS_USE_RXDATA;
+		SPITransaction.tx_data[0] = cmd;
+		for (int i=0;i<len;i++) {
+			SPITransaction.tx_data[i+1] = dataout ? dataout[i] : NOP;
+		}
+		rx = SPITransaction.rx_data;
+	} else if (dataout && Nrf24_isPoolPayload(dev, dataout)) {
+		// The byte in front of a pool payload is reserved for the command
+		uint8_t * slot = (uint8_t *)dataout - 1;
+		slot[0] = cmd;
+		SPITransaction.tx_buffer = slot;
+		SPITransaction.rx_buffer = dev->dmaRx;
+		rx = dev->dmaRx;
+	} else if (datain && Nrf24_isPoolPayload(dev, datain)) {
+		// Only the command matters on MOSI, STATUS lands in the reserved byte
+		dev->dmaTx[0] = cmd;
+		memset(&dev->dmaTx[1], NOP, len);
+		SPITransaction.tx_buffer = dev->dmaTx;
+		SPITransaction.rx_buffer = datain - 1;
+		rx = datain - 1;
+		datain = NULL;
+	} else {
+		dev->dmaTx[0] = cmd;
+		if (dataout) {
+			memcpy(&dev->dmaTx[1], dataout, len);
+		} else {
+			memset(&dev->dmaTx[1], NOP, len);
+		}
+		SPITransaction.tx_buffer = dev->dmaTx;
+		SPITransaction.rx_buffer = dev->dmaRx;
+		rx = dev->dmaRx;
+	}
+
+	// With software CS another device on the host must not be clocked while CSN is low,
+	// so the bus is held from CSN low to CSN high
+	if (!dev->csnHw) Nrf24_acquireBus(dev);
+	spi_csnLow(dev);
+	spi_transmit( dev, &SPITransaction );
+	spi_csnHi(dev);
+	if (!dev->csnHw) Nrf24_releaseBus(dev);
+
+	if (datain) memcpy(datain, &rx[1], len);
+	// STATUS comes for free with every command
+	dev->status = rx[0];
+	dev->statusTime = esp_timer_get_time();
+	Nrf24_unlock(dev);
+	return rx[0];
+}
+
 uint8_t spi_transfer(NRF24_t * dev, uint8_t address) {
 	uint8_t datain[1];
 	uint8_t dataout[1];
@@ -128,11 +461,146 @@ uint8_t spi_transfer(NRF24_t * dev, uint8_t address) {
 	return datain[0];
 }
 
+// Holds the SPI bus across a burst of commands so that the transactions in
+// between skip bus arbitration. Calls may be nested.
+// The burst also holds the IRQ task off the chip.
+void Nrf24_acquireBus(NRF24_t * dev)
+{
+	Nrf24_lock(dev);
+	if (dev->busDepth++ == 0 && dev->_SPIHandle) {
+		spi_device_acquire_bus( dev->_SPIHandle, portMAX_DELAY );
+	}
+}
+
+void Nrf24_releaseBus(NRF24_t * dev)
+{
+	if (dev->busDepth == 0) return;
+	if (--dev->busDepth == 0 && dev->_SPIHandle) {
+		spi_device_release_bus( dev->_SPIHandle );
+	}
+	Nrf24_unlock(dev);
+}
+
+// Selects polling transactions (true) or interrupt driven transactions (false)
+void Nrf24_setPollingMode(NRF24_t * dev, bool polling)
+{
+	dev->polling = polling;
+}
+
+// Changes the SPI clock of dev by adding it to the bus again.
+// Must not be called while the bus is acquired.
+// On failure the previous clock stays in use and the error is returned.
+esp_err_t Nrf24_setClockSpeed(NRF24_t * dev, int clockSpeed)
+{
+	if (dev->busDepth) return ESP_ERR_INVALID_STATE;
+	if (clockSpeed == dev->clockSpeed) return ESP_OK;
+	int previous = dev->clockSpeed;
+	spi_device_handle_t old = dev->_SPIHandle;
+	Nrf24_lock(dev);
+	// With software CS add the new clock first, so the old device stays usable when that fails.
+	// A hardware CS pin cannot be routed to two devices at once.
+	esp_err_t ret = ESP_FAIL;
+	if (!dev->csnHw) ret = spi_add_device(dev, clockSpeed);
+	if (ret == ESP_OK) {
+		spi_bus_remove_device(old);
+	} else {
+		// Hardware CS or no free device slot on the host, make room with the old device
+		spi_bus_remove_device(old);
+		dev->_SPIHandle = NULL;
+		ret = spi_add_device(dev, clockSpeed);
+		if (ret != ESP_OK) {
+			ESP_LOGE(TAG, "Cannot set SPI clock %d: %d", clockSpeed, ret);
+			// The slot was just freed, so the previous clock can normally be added back
+			if (spi_add_device(dev, previous) != ESP_OK) ESP_LOGE(TAG, "SPI device lost");
+		}
+	}
+	Nrf24_unlock(dev);
+	return ret;
+}
+
+// Writes test patterns to RX_ADDR_P0 and TX_ADDR and reads them back
+static bool Nrf24_clockStable(NRF24_t * dev)
+{
+	uint8_t width = Nrf24_getAddressWidth(dev);
+	uint8_t pattern[mirf_ADDR_LEN];
+	uint8_t buffer[mirf_ADDR_LEN];
+	for (int round=0;round<SPI_TRAIN_ROUNDS;round++) {
+		for (int i=0;i<width;i++) {
+			switch (round & 3) {
+			case 0: pattern[i] = 0x55; break;
+			case 1: pattern[i] = 0xAA; break;
+			case 2: pattern[i] = 1 << ((round/4 + i) & 7); break; // Walking one
+			default: pattern[i] = (uint8_t)(round * 37 + i * 101); break;
+			}
+		}
+		// Shadow copies are bypassed, they keep the addresses to restore
+		uint8_t reg = (round & 4) ? TX_ADDR : RX_ADDR_P0;
+		Nrf24_command(dev, W_REGISTER | (REGISTER_MASK & reg), pattern, NULL, width);
+		Nrf24_command(dev, R_REGISTER | (REGISTER_MASK & reg), NULL, buffer, width);
+		if (memcmp(pattern, buffer, width) != 0) return false;
+	}
+	return true;
+}
+
+// Steps the SPI clock up to maxClock and settles one step below the fastest
+// clock that passed every readback, leaving a margin for temperature and noise.
+// When no step passes, or maxClock is below the slowest step, the clock from before is kept
+// (limited to maxClock). The chip registers are restored from the shadow copy and the FIFOs
+// and flags are cleared afterwards. Returns the selected clock in Hz,
+// or -1 when no clock was verified or the selected one could not be set.
+int Nrf24_trainClock(NRF24_t * dev, int maxClock)
+{
+	int previous = dev->clockSpeed;
+	int passed = -1;
+	int tried = 0;
+	int steps = sizeof(SPI_TrainSteps) / sizeof(SPI_TrainSteps[0]);
+	for (int i=0;i<steps && SPI_TrainSteps[i]<=maxClock;i++) {
+		if (Nrf24_setClockSpeed(dev, SPI_TrainSteps[i]) != ESP_OK) break;
+		tried++;
+		Nrf24_acquireBus(dev);
+		bool stable = Nrf24_clockStable(dev);
+		Nrf24_releaseBus(dev);
+		ESP_LOGI(TAG, "SPI clock %d %s", SPI_TrainSteps[i], stable ? "stable" : "unstable");
+		if (!stable) break;
+		passed = i;
+	}
+
+	// Without a passing step keep the clock from before, but never above maxClock
+	int selected = (previous < maxClock) ? previous : maxClock;
+	if (passed >= 0) selected = SPI_TrainSteps[(passed > 0) ? passed - 1 : 0];
+	bool set = Nrf24_setClockSpeed(dev, selected) == ESP_OK;
+
+	// A corrupted command may have hit any register, so write back everything
+	uint8_t buffer[mirf_ADDR_LEN];
+	Nrf24_acquireBus(dev);
+	for (uint8_t reg=0;reg<32;reg++) {
+		uint8_t * addr = shadowAddr(dev, reg);
+		if (addr) {
+			memcpy(buffer, addr, mirf_ADDR_LEN);
+			Nrf24_writeRegister(dev, reg, buffer, Nrf24_getAddressWidth(dev));
+		} else if (isShadowed(reg) && reg != STATUS) {
+			Nrf24_configRegister(dev, reg, dev->regs[reg]);
+		}
+	}
+	// and may have queued garbage or raised flags
+	Nrf24_command(dev, FLUSH_TX, NULL, NULL, 0);
+	Nrf24_command(dev, FLUSH_RX, NULL, NULL, 0);
+	Nrf24_configRegister(dev, STATUS, (1 << RX_DR) | (1 << TX_DS) | (1 << MAX_RT));
+	Nrf24_releaseBus(dev);
+	if (tried > 0 && passed < 0) ESP_LOGW(TAG, "No SPI clock passed, check the wiring");
+	ESP_LOGI(TAG, "SPI clock set to %d", dev->clockSpeed);
+	if (passed < 0 || !set) return -1;
+	return selected;
+}
+
+// With hardware CS control the SPI peripheral drives CSN for each transaction
 void spi_csnHi(NRF24_t * dev) {
+	if (dev->csnHw) return;
 	gpio_set_level( dev->csnPin, 1 );
 }
 
 void spi_csnLow(NRF24_t * dev) {
+	if (dev->csnHw) return;
 	gpio_set_level( dev->csnPin, 0 );
 }
 
@@ -143,11 +611,13 @@ void Nrf24_config(NRF24_t * dev, uint8_t channel, uint8_t payload)
 {
 	dev->channel = channel;
 	dev->payload = payload;
+	Nrf24_acquireBus(dev);
 	Nrf24_configRegister(dev, RF_CH, dev->channel); // Set RF channel
 	Nrf24_configRegister(dev, RX_PW_P0, dev->payload); // Set length of incoming payload
 	Nrf24_configRegister(dev, RX_PW_P1, dev->payload);
 	Nrf24_powerUpRx(dev); // Start receiver
 	Nrf24_flushRx(dev);
+	Nrf24_releaseBus(dev);
 }
 
 // Sets the receiving device address
@@ -155,10 +625,11 @@ void Nrf24_config(NRF24_t * dev, uint8_t channel, uint8_t payload)
 esp_err_t Nrf24_setRADDR(NRF24_t * dev, uint8_t * adr)
 {
 	esp_err_t ret = ESP_OK;
-	Nrf24_writeRegister(dev, RX_ADDR_P1, adr, mirf_ADDR_LEN);
+	uint8_t width = Nrf24_getAddressWidth(dev);
+	Nrf24_writeRegister(dev, RX_ADDR_P1, adr, width);
 	uint8_t buffer[5];
-	Nrf24_readRegister(dev, RX_ADDR_P1, buffer, sizeof(buffer));
-	for (int i=0;i<5;i++) {
+	Nrf24_readRegister(dev, RX_ADDR_P1, buffer, width);
+	for (int i=0;i<width;i++) {
 		ESP_LOGD(TAG, "adr[%d]=0x%x buffer[%d]=0x%x", i, adr[i], i, buffer[i]);
 		if (adr[i] != buffer[i]) ret = ESP_FAIL;
 	}
@@ -170,11 +641,12 @@ esp_err_t Nrf24_setRADDR(NRF24_t * dev, uint8_t * adr)
 esp_err_t Nrf24_setTADDR(NRF24_t * dev, uint8_t * adr)
 {
 	esp_err_t ret = ESP_OK;
-	Nrf24_writeRegister(dev, RX_ADDR_P0, adr, mirf_ADDR_LEN); //RX_ADDR_P0 must be set to the sending addr for auto ack to work.
-	Nrf24_writeRegister(dev, TX_ADDR, adr, mirf_ADDR_LEN);
+	uint8_t width = Nrf24_getAddressWidth(dev);
+	Nrf24_writeRegister(dev, RX_ADDR_P0, adr, width); //RX_ADDR_P0 must be set to the sending addr for auto ack to work.
+	Nrf24_writeRegister(dev, TX_ADDR, adr, width);
 	uint8_t buffer[5];
-	Nrf24_readRegister(dev, RX_ADDR_P0, buffer, sizeof(buffer));
-	for (int i=0;i<5;i++) {
+	Nrf24_readRegister(dev, RX_ADDR_P0, buffer, width);
+	for (int i=0;i<width;i++) {
 		ESP_LOGD(TAG, "adr[%d]=0x%x buffer[%d]=0x%x", i, adr[i], i, buffer[i]);
 		if (adr[i] != buffer[i]) ret = ESP_FAIL;
 	}
@@ -184,8 +656,7 @@ esp_err_t Nrf24_setTADDR(NRF24_t * dev, uint8_t * adr)
 // Add the receiving device address
 void Nrf24_addRADDR(NRF24_t * dev, uint8_t pipe, uint8_t adr)
 {
-	uint8_t value;
-	Nrf24_readRegister(dev, EN_RXADDR, &value, 1);
+	uint8_t value = dev->regs[EN_RXADDR];
 
 	if (pipe == 2) {
 		Nrf24_configRegister(dev, RX_PW_P2, dev->payload);
@@ -213,12 +684,16 @@ void Nrf24_addRADDR(NRF24_t * dev, uint8_t pipe, uint8_t adr)
 // Checks if data is available for reading
 extern bool Nrf24_dataReady(NRF24_t * dev)
 {
+	if (dev->irqTask) return uxQueueMessagesWaiting(dev->rxQueue) > 0;
+	if (dev->dedup) {
+		// The payload has to be read to know whether it is a duplicate, hold it for getData()
+		if (!dev->dedup->heldValid) dev->dedup->heldValid = Nrf24_drainRx(dev, &dev->dedup->held, 1) != 0;
+		return dev->dedup->heldValid;
+	}
 	// See note in getData() function - just checking RX_DR isn't good enough
-	uint8_t status = Nrf24_getStatus(dev);
+	uint8_t status = Nrf24_pollStatus(dev, (1 << RX_DR));
 	//printf("Nrf24_dataReady status=0x%x\n", status);
 	if ( status & (1 << RX_DR) ) {
-		// Save status
-		dev->status = status;
 		return 1;
 	}
 	// We can short circuit on RX_DR, but if it's not set, we still need
@@ -229,6 +704,12 @@ extern bool Nrf24_dataReady(NRF24_t * dev)
 
 // Get pipe number for reading
 uint8_t Nrf24_getDataPipe(NRF24_t * dev) {
+	if (dev->irqTask) {
+		rf24_packet_t packet;
+		if (xQueuePeek(dev->rxQueue, &packet, 0) == pdTRUE) return packet.pipe;
+		return 0x07;
+	}
+	if (dev->dedup && dev->dedup->heldValid) return dev->dedup->held.pipe;
 	//uint8_t status = Nrf24_getStatus(dev);
 	//printf("dev->status=0x%x\n",dev->status);
 	return ((dev->status & 0x0E) >> 1);
@@ -241,13 +722,33 @@ extern bool Nrf24_rxFifoEmpty(NRF24_t * dev)
 	return (fifoStatus & (1 << RX_EMPTY));
 }
 
+extern bool Nrf24_txFifoEmpty(NRF24_t * dev)
+{
+	uint8_t fifoStatus;
+	Nrf24_readRegister(dev, FIFO_STATUS, &fifoStatus, sizeof(fifoStatus));
+	return (fifoStatus & (1 << TX_EMPTY));
+}
+
 // Reads payload bytes into data array
 extern void Nrf24_getData(NRF24_t * dev, uint8_t * data)
 {
-	spi_csnLow(dev); // Pull down chip select
-	spi_transfer(dev, R_RX_PAYLOAD ); // Send cmd to read rx payload
-	spi_read_byte(dev, data, data, dev->payload); // Read payload
-	spi_csnHi(dev); // Pull up chip select
+	if (dev->irqTask) {
+		rf24_packet_t packet;
+		if (xQueueReceive(dev->rxQueue, &packet, 0) == pdTRUE) {
+			memcpy(data, packet.data, (packet.length < dev->payload) ? packet.length : dev->payload);
+		}
+		return;
+	}
+	if (dev->dedup) {
+		if (Nrf24_dataReady(dev)) {
+			rf24_packet_t * packet = &dev->dedup->held;
+			memcpy(data, packet->data, (packet->length < dev->payload) ? packet->length : dev->payload);
+			dev->dedup->heldValid = false;
+		}
+		return;
+	}
+	Nrf24_acquireBus(dev);
+	Nrf24_command(dev, R_RX_PAYLOAD, NULL, data, dev->payload); // Read payload
 	// NVI: per product spec, p 67, note c:
 	// "The RX_DR IRQ is asserted by a new packet arrival event. The procedure
 	// for handling this interrupt should be: 1) read payload through SPI,
@@ -257,44 +758,513 @@ extern void Nrf24_getData(NRF24_t * dev, uint8_t * data)
 	// So if we're going to clear RX_DR here, we need to check the RX FIFO
 	// in the dataReady() function
 	Nrf24_configRegister(dev, STATUS, (1 << RX_DR)); // Reset status register
+	Nrf24_releaseBus(dev);
+}
+
+// Payload length of the packet at the head of the RX FIFO, which arrived on pipe
+static uint8_t Nrf24_rxLength(NRF24_t * dev, uint8_t pipe)
+{
+	if (dev->regs[DYNPD] & (1 << pipe)) return Nrf24_getDynamicPayloadSize(dev);
+	return dev->payload;
+}
+
+// Reads a payload of any length into data and returns its length.
+// Works for pipes with fixed and dynamic payload length; 0 means nothing was read.
+uint8_t Nrf24_getDataDynamic(NRF24_t * dev, uint8_t * data)
+{
+	if (dev->irqTask) {
+		rf24_packet_t packet;
+		if (xQueueReceive(dev->rxQueue, &packet, 0) != pdTRUE) return 0;
+		memcpy(data, packet.data, packet.length);
+		return packet.length;
+	}
+	if (dev->dedup) {
+		rf24_packet_t packet;
+		if (Nrf24_drainRx(dev, &packet, 1) == 0) return 0;
+		memcpy(data, packet.data, packet.length);
+		return packet.length;
+	}
+	Nrf24_acquireBus(dev);
+	uint8_t pipe = (Nrf24_getStatus(dev) >> RX_P_NO) & 0x07;
+	uint8_t len = (pipe > 5) ? 0 : Nrf24_rxLength(dev, pipe);
+	if (len) Nrf24_command(dev, R_RX_PAYLOAD, NULL, data, len);
+	Nrf24_configRegister(dev, STATUS, (1 << RX_DR)); // Reset status register
+	Nrf24_releaseBus(dev);
+	return len;
+}
+
+// Reads the next payload straight into a pool slot and lends it out.
+// Return it with Nrf24_freePayload. Returns NULL when nothing is waiting or the pool is empty.
+// Reads the chip directly, so it cannot be combined with the IRQ task.
+uint8_t * Nrf24_receivePayload(NRF24_t * dev, uint8_t * pipe, uint8_t * len)
+{
+	if (dev->irqTask) return NULL;
+	uint8_t * payload = NULL;
+	Nrf24_acquireBus(dev);
+	uint8_t p = (Nrf24_getStatus(dev) >> RX_P_NO) & 0x07;
+	uint8_t length = (p > 5) ? 0 : Nrf24_rxLength(dev, p);
+	if (length) payload = Nrf24_allocPayload(dev, 0);
+	if (payload) {
+		Nrf24_command(dev, R_RX_PAYLOAD, NULL, payload, length);
+		Nrf24_configRegister(dev, STATUS, (1 << RX_DR)); // Reset status register
+		if (pipe) *pipe = p;
+		if (len) *len = length;
+	}
+	Nrf24_releaseBus(dev);
+	return payload;
+}
+
+// Reads every payload waiting in the RX FIFO (at most max, the FIFO holds 3)
+// following the procedure in the product spec: read payload, clear RX_DR,
+// check for more payloads. RX_P_NO in the STATUS byte captured by each command
+// tells whether the FIFO is empty, so no FIFO_STATUS read is needed.
+// Returns the number of packets stored in packets.
+static uint8_t Nrf24_readRxFifo(NRF24_t * dev, rf24_packet_t * packets, uint8_t max)
+{
+	uint8_t count = 0;
+	Nrf24_acquireBus(dev);
+	uint8_t status = Nrf24_getStatus(dev);
+	while (count < max) {
+		uint8_t pipe = (status >> RX_P_NO) & 0x07;
+		if (pipe > 5) {
+			// RX FIFO empty. RX_DR can still be set, e.g. after FLUSH_RX, and would hold IRQ low
+			if (status & (1 << RX_DR)) Nrf24_configRegister(dev, STATUS, (1 << RX_DR));
+			break;
+		}
+		uint8_t len = Nrf24_rxLength(dev, pipe);
+		if (len == 0) {
+			// Corrupted packet, the RX FIFO has been flushed
+			Nrf24_configRegister(dev, STATUS, (1 << RX_DR));
+			break;
+		}
+		packets[count].pipe = pipe;
+		packets[count].length = len;
+		packets[count].timestamp = esp_timer_get_time();
+		Nrf24_command(dev, R_RX_PAYLOAD, NULL, packets[count].data, len);
+		Nrf24_configRegister(dev, STATUS, (1 << RX_DR));
+		// STATUS shifted out by the write already shows the next payload
+		status = dev->status;
+		if (dev->dedup && (dev->dedup->pipes & (1 << pipe))
+			&& !Nrf24_dedupCheck(dev->dedup, pipe, packets[count].data, len)) continue;
+		count++;
+	}
+	Nrf24_releaseBus(dev);
+	return count;
+}
+
+// Reads every payload waiting in the RX FIFO.
+// When the IRQ task runs, the payloads it has already read are returned instead.
+uint8_t Nrf24_drainRx(NRF24_t * dev, rf24_packet_t * packets, uint8_t max)
+{
+	uint8_t count = 0;
+	if (dev->irqTask) {
+		while (count < max && xQueueReceive(dev->rxQueue, &packets[count], 0) == pdTRUE) count++;
+		return count;
+	}
+	if (dev->dedup && dev->dedup->heldValid && max > 0) {
+		packets[count++] = dev->dedup->held;
+		dev->dedup->heldValid = false;
+	}
+	return count + Nrf24_readRxFifo(dev, &packets[count], max - count);
+}
+
+// IRQ is active low and asserted while any unmasked flag in STATUS is set
+static void IRAM_ATTR Nrf24_irqHandler(void * arg)
+{
+	NRF24_t * dev = (NRF24_t *)arg;
+	BaseType_t woken = pdFALSE;
+	dev->irqTime = esp_timer_get_time();
+	vTaskNotifyGiveFromISR(dev->irqTask, &woken);
+	portYIELD_FROM_ISR(woken);
+}
+
+// Packet queued by Nrf24_sendAsync
+typedef struct {
+	uint32_t handle;
+	uint8_t cmd;
+	uint8_t len;
+	int64_t submitted;
+	uint8_t data[mirf_MAX_PAYLOAD];
+} async_packet_t;
+
+// Hands the next queued asynchronous packet to the chip
+static void Nrf24_startAsync(NRF24_t * dev)
+{
+	async_packet_t packet;
+	if (dev->asyncQueue == NULL || dev->asyncHandle != 0) return;
+	if (xQueueReceive(dev->asyncQueue, &packet, 0) != pdTRUE) return;
+	dev->asyncHandle = packet.handle;
+	dev->asyncStart = packet.submitted;
+	dev->asyncDeadline = esp_timer_get_time() + ASYNC_TIMEOUT * 1000;
+	Nrf24_ceLow(dev);
+	Nrf24_powerUpTx(dev); // Set to transmitter mode , Power up
+	Nrf24_command(dev, FLUSH_TX, NULL, NULL, 0); // Flush tx fifo
+	Nrf24_command(dev, packet.cmd, packet.data, NULL, packet.len); // Write payload
+	Nrf24_ceHi(dev); // Start transmission
+}
+
+// Adds a finished packet to the statistics. observe is OBSERVE_TX, or -1 to read it.
+// PLOS_CNT stops at 15, so it is restarted by writing RF_CH and the wrap is counted.
+static void Nrf24_recordTx(NRF24_t * dev, rf24_tx_result_e result, int observe, int64_t latency)
+{
+	if (dev->stats == NULL) return;
+	if (observe < 0) {
+		uint8_t value;
+		Nrf24_readRegister(dev, OBSERVE_TX, &value, 1);
+		observe = value;
+	}
+	bool plosWrap = ((observe >> PLOS_CNT) & 0x0F) == 0x0F;
+	if (plosWrap) Nrf24_configRegister(dev, RF_CH, dev->regs[RF_CH]);
+	int retries = (result == RF24_TX_TIMEOUT) ? -1 : (observe >> ARC_CNT) & 0x0F;
+	Nrf24_statsRecord(dev->stats, dev->addr[2], Nrf24_getAddressWidth(dev), result, retries, latency, plosWrap);
+}
+
+// Outcome of a streamed packet. ARC_CNT and latency are not known for each packet.
+static void Nrf24_streamResult(NRF24_t * dev, rf24_tx_result_e * results, size_t index, rf24_tx_result_e result)
+{
+	if (results) results[index] = result;
+	if (dev->stats) Nrf24_statsRecord(dev->stats, dev->addr[2], Nrf24_getAddressWidth(dev), result, -1, -1, false);
+}
+
+// Finishes the asynchronous packet in the air and returns the chip to listening
+static void Nrf24_finishAsync(NRF24_t * dev, uint8_t status, rf24_tx_report_t * report)
+{
+	uint8_t observe;
+	Nrf24_readRegister(dev, OBSERVE_TX, &observe, 1);
+	report->handle = dev->asyncHandle;
+	report->result = (status & (1 << TX_DS)) ? RF24_TX_ACKED : RF24_TX_MAX_RT;
+	report->retries = (observe >> ARC_CNT) & 0x0F;
+	report->latency = dev->irqTime - dev->asyncStart;
+	Nrf24_recordTx(dev, report->result, observe, report->latency);
+	dev->asyncHandle = 0;
+	Nrf24_powerUpRx(dev);
+}
+
+// Reads STATUS once and hands received payloads and TX outcomes to the waiting tasks
+static void Nrf24_serviceIrq(NRF24_t * dev)
+{
+	rf24_packet_t packets[3];
+	rf24_tx_report_t report;
+	bool finished = false;
+
+	Nrf24_acquireBus(dev);
+	uint8_t status = Nrf24_getStatus(dev);
+	if (status & (1 << RX_DR)) {
+		uint8_t count = Nrf24_readRxFifo(dev, packets, 3);
+		for (int i=0;i<count;i++) {
+			packets[i].timestamp = dev->irqTime;
+			if (xQueueSend(dev->rxQueue, &packets[i], 0) != pdTRUE) dev->rxDropped++;
+		}
+	}
+	// While streaming, the streaming code handles TX_DS and MAX_RT itself
+	if ((status & ((1 << TX_DS) | (1 << MAX_RT))) && !dev->streaming) {
+		// Stop retransmitting before MAX_RT is cleared
+		if (status & (1 << MAX_RT)) Nrf24_ceLow(dev);
+		if (dev->asyncHandle) {
+			Nrf24_finishAsync(dev, status, &report);
+			finished = true;
+		} else {
+			Nrf24_configRegister(dev, STATUS, status & ((1 << TX_DS) | (1 << MAX_RT)));
+			xQueueOverwrite(dev->txQueue, &status);
+		}
+	} else if (dev->asyncHandle && !dev->streaming && esp_timer_get_time() > dev->asyncDeadline) {
+		// Missed edge, chip reset or CE glitch: give the packet up so the queue moves on
+		ESP_LOGW(TAG, "Async handle %"PRIu32" timed out", dev->asyncHandle);
+		Nrf24_ceLow(dev);
+		Nrf24_flushTx(dev);
+		report.handle = dev->asyncHandle;
+		report.result = RF24_TX_TIMEOUT;
+		report.retries = 0;
+		report.latency = esp_timer_get_time() - dev->asyncStart;
+		Nrf24_recordTx(dev, RF24_TX_TIMEOUT, 0, -1);
+		dev->asyncHandle = 0;
+		Nrf24_powerUpRx(dev);
+		finished = true;
+	}
+	if (!dev->streaming) Nrf24_startAsync(dev);
+	Nrf24_releaseBus(dev);
+
+	// Report outside the lock so the callback may use the driver
+	if (finished) {
+		if (dev->txCallback) {
+			dev->txCallback(&report, dev->txCallbackArg);
+		} else if (xQueueSend(dev->txReports, &report, 0) != pdTRUE) {
+			ESP_LOGW(TAG, "TX report queue full, handle %"PRIu32" dropped", report.handle);
+		}
+	}
+}
+
+static void Nrf24_irqTask(void * arg)
+{
+	NRF24_t * dev = (NRF24_t *)arg;
+	TickType_t wait = portMAX_DELAY;
+	while (1) {
+		ulTaskNotifyTake(pdTRUE, wait);
+		// Nrf24_disableIrq() waits for this before it frees the queues and the lock
+		if (dev->irqStop) {
+			dev->irqStop = false;
+			vTaskDelete(NULL);
+		}
+		Nrf24_serviceIrq(dev);
+		// A new event may have arrived while servicing; no new edge is seen then
+		int rounds = 1;
+		while (gpio_get_level(dev->irqPin) == 0 && !dev->streaming && !dev->irqStop && rounds++ < IRQ_MAX_ROUNDS) {
+			Nrf24_serviceIrq(dev);
+		}
+		// Should IRQ stay low anyway, look again after a tick instead of spinning
+		wait = (gpio_get_level(dev->irqPin) == 0 && !dev->streaming) ? 1 : portMAX_DELAY;
+		// Wake up at the deadline of the asynchronous packet in the air
+		if (dev->asyncHandle) {
+			int64_t left = dev->asyncDeadline - esp_timer_get_time();
+			TickType_t ticks = (left > 0) ? pdMS_TO_TICKS(left / 1000) + 1 : 1;
+			if (ticks < wait) wait = ticks;
+		}
+	}
+}
+
+// Lets a driver task service the IRQ pin instead of polling STATUS.
+// Received payloads are queued (up to rxQueueLength) and delivered by Nrf24_dataReady()/Nrf24_getData(),
+// Nrf24_drainRx() or Nrf24_waitData(). Nrf24_isSend() sleeps until TX_DS or MAX_RT.
+// TX_DS is unmasked so that successful transmissions raise IRQ too.
+esp_err_t Nrf24_enableIrq(NRF24_t * dev, int irqPin, UBaseType_t rxQueueLength)
+{
+	if (dev->irqTask) return ESP_ERR_INVALID_STATE;
+
+	dev->lock = xSemaphoreCreateRecursiveMutex();
+	dev->rxQueue = xQueueCreate(rxQueueLength, sizeof(rf24_packet_t));
+	dev->txQueue = xQueueCreate(1, sizeof(uint8_t));
+	if (dev->lock == NULL || dev->rxQueue == NULL || dev->txQueue == NULL) {
+		Nrf24_disableIrq(dev);
+		return ESP_ERR_NO_MEM;
+	}
+
+	gpio_config_t io_conf = {};
+	io_conf.intr_type = GPIO_INTR_NEGEDGE;
+	io_conf.pin_bit_mask = (1ULL << irqPin);
+	io_conf.mode = GPIO_MODE_INPUT;
+	io_conf.pull_up_en = 1;
+	gpio_config(&io_conf);
+
+	// The ISR service may already be installed by the application
+	esp_err_t ret = gpio_install_isr_service(0);
+	if (ret != ESP_OK && ret != ESP_ERR_INVALID_STATE) {
+		Nrf24_disableIrq(dev);
+		return ret;
+	}
+
+	dev->irqPin = irqPin;
+	if (xTaskCreate(Nrf24_irqTask, "NRF24_IRQ", 1024*3, dev, CONFIG_IRQ_TASK_PRIORITY, &dev->irqTask) != pdPASS) {
+		dev->irqTask = NULL;
+		Nrf24_disableIrq(dev);
+		return ESP_ERR_NO_MEM;
+	}
+	gpio_isr_handler_add(irqPin, Nrf24_irqHandler, dev);
+
+	// Unmask TX_DS, keeping PWR_UP and PRIM_RX as they are
+	Nrf24_acquireBus(dev);
+	dev->config = dev->config & ~(1 << MASK_TX_DS);
+	Nrf24_configRegister(dev, CONFIG, dev->config | (dev->regs[CONFIG] & ((1 << PWR_UP) | (1 << PRIM_RX))));
+	Nrf24_releaseBus(dev);
+	// Service anything that is already pending
+	xTaskNotifyGive(dev->irqTask);
+	return ESP_OK;
+}
+
+// Stops the IRQ task and goes back to polling STATUS.
+// Must not be called from the TX callback.
+void Nrf24_disableIrq(NRF24_t * dev)
+{
+	if (dev->irqTask) {
+		gpio_isr_handler_remove(dev->irqPin);
+		// The task may be in the middle of a callback, let it finish and exit by itself
+		dev->irqStop = true;
+		xTaskNotifyGive(dev->irqTask);
+		while (dev->irqStop) vTaskDelay(1);
+		dev->irqTask = NULL;
+		Nrf24_acquireBus(dev);
+		dev->config = dev->config | (1 << MASK_TX_DS);
+		Nrf24_configRegister(dev, CONFIG, dev->config | (dev->regs[CONFIG] & ((1 << PWR_UP) | (1 << PRIM_RX))));
+		Nrf24_releaseBus(dev);
+	}
+	if (dev->asyncQueue) vQueueDelete(dev->asyncQueue);
+	if (dev->txReports) vQueueDelete(dev->txReports);
+	dev->asyncQueue = NULL;
+	dev->txReports = NULL;
+	dev->txCallback = NULL;
+	dev->asyncHandle = 0;
+	if (dev->rxQueue) vQueueDelete(dev->rxQueue);
+	if (dev->txQueue) vQueueDelete(dev->txQueue);
+	if (dev->lock) vSemaphoreDelete(dev->lock);
+	dev->rxQueue = NULL;
+	dev->txQueue = NULL;
+	dev->lock = NULL;
+	dev->irqPin = -1;
+}
+
+// Enables Nrf24_sendAsync() with room for depth waiting packets. Needs Nrf24_enableIrq().
+// Completions are passed to callback on the IRQ task. Keep it short.
+// With a NULL callback they are queued for Nrf24_getTxReport() instead.
+// Do not mix with the blocking send functions while packets are pending.
+esp_err_t Nrf24_enableAsync(NRF24_t * dev, UBaseType_t depth, rf24_tx_callback_t callback, void * arg)
+{
+	if (dev->irqTask == NULL) return ESP_ERR_INVALID_STATE;
+	if (dev->asyncQueue) return ESP_ERR_INVALID_STATE;
+	dev->asyncQueue = xQueueCreate(depth, sizeof(async_packet_t));
+	if (dev->asyncQueue == NULL) return ESP_ERR_NO_MEM;
+	if (callback == NULL) {
+		dev->txReports = xQueueCreate(depth + 1, sizeof(rf24_tx_report_t));
+		if (dev->txReports == NULL) {
+			vQueueDelete(dev->asyncQueue);
+			dev->asyncQueue = NULL;
+			return ESP_ERR_NO_MEM;
+		}
+	}
+	dev->txCallback = callback;
+	dev->txCallbackArg = arg;
+	return ESP_OK;
+}
+
+// Queues len bytes (0 means dev->payload) for transmission and returns at once.
+// Without dynamic payload length on pipe 0 the payload is padded to dev->payload bytes.
+// The handle in the completion report matches the one stored in handle.
+// Returns ESP_ERR_NO_MEM when depth packets are already waiting.
+esp_err_t Nrf24_sendAsync(NRF24_t * dev, uint8_t * value, uint8_t len, uint32_t * handle)
+{
+	async_packet_t packet;
+	if (dev->asyncQueue == NULL) return ESP_ERR_INVALID_STATE;
+	if (len == 0) len = dev->payload;
+	if (len > mirf_MAX_PAYLOAD) return ESP_ERR_INVALID_SIZE;
+
+	Nrf24_lock(dev);
+	packet.handle = dev->asyncNext++;
+	if (dev->asyncNext == 0) dev->asyncNext = 1;
+	Nrf24_unlock(dev);
+	packet.cmd = W_TX_PAYLOAD;
+	packet.submitted = esp_timer_get_time();
+	memcpy(packet.data, value, len);
+	// A fixed width receiver drops shorter frames, pad as Nrf24_sendPacket does
+	if (!(dev->regs[DYNPD] & (1 << DPL_P0)) && len < dev->payload) {
+		memset(&packet.data[len], 0, dev->payload - len);
+		len = dev->payload;
+	}
+	packet.len = len;
+	if (xQueueSend(dev->asyncQueue, &packet, 0) != pdTRUE) return ESP_ERR_NO_MEM;
+	if (handle) *handle = packet.handle;
+	// Let the IRQ task start it if the chip is idle
+	xTaskNotifyGive(dev->irqTask);
+	return ESP_OK;
+}
+
+// Waits up to timeout ms for the next completion report when no callback is set
+bool Nrf24_getTxReport(NRF24_t * dev, rf24_tx_report_t * report, int timeout)
+{
+	if (dev->txReports == NULL) return false;
+	return xQueueReceive(dev->txReports, report, pdMS_TO_TICKS(timeout)) == pdTRUE;
+}
+
+// Waits up to timeout ms for a received payload.
+// Sleeps on the IRQ task when it runs, otherwise polls once per tick.
+bool Nrf24_waitData(NRF24_t * dev, rf24_packet_t * packet, int timeout)
+{
+	if (dev->irqTask) {
+		return xQueueReceive(dev->rxQueue, packet, pdMS_TO_TICKS(timeout)) == pdTRUE;
+	}
+	TickType_t startTick = xTaskGetTickCount();
+	while (1) {
+		if (Nrf24_drainRx(dev, packet, 1)) return true;
+		TickType_t diffTick = xTaskGetTickCount() - startTick;
+		if ( (diffTick * portTICK_PERIOD_MS) > timeout) return false;
+		vTaskDelay(1);
+	}
 }
 
 // Clocks only one byte into the given MiRF register
 void Nrf24_configRegister(NRF24_t * dev, uint8_t reg, uint8_t value)
 {
-	spi_csnLow(dev);
-	spi_transfer(dev, W_REGISTER | (REGISTER_MASK & reg));
-	spi_transfer(dev, value);
-	spi_csnHi(dev);
+	reg = reg & REGISTER_MASK;
+	if (isShadowed(reg)) dev->regs[reg] = value;
+	Nrf24_command(dev, W_REGISTER | reg, &value, NULL, 1);
+	// The captured STATUS predates this write; interrupt flags are cleared by writing 1
+	if (reg == STATUS) dev->status &= ~(value & ((1 << RX_DR) | (1 << TX_DS) | (1 << MAX_RT)));
 }
 
 // Reads an array of bytes from the given start position in the MiRF registers
 void Nrf24_readRegister(NRF24_t * dev, uint8_t reg, uint8_t * value, uint8_t len)
 {
-	spi_csnLow(dev);
-	spi_transfer(dev, R_REGISTER | (REGISTER_MASK & reg));
-	spi_read_byte(dev, value, value, len);
-	spi_csnHi(dev);
+	reg = reg & REGISTER_MASK;
+	Nrf24_command(dev, R_REGISTER | reg, NULL, value, len);
+	if (isShadowed(reg)) dev->regs[reg] = value[0];
+	uint8_t * addr = shadowAddr(dev, reg);
+	if (addr) memcpy(addr, value, (len < 5) ? len : 5);
 }
 
 // Writes an array of bytes into inte the MiRF registers
 void Nrf24_writeRegister(NRF24_t * dev, uint8_t reg, uint8_t * value, uint8_t len)
 {
-	spi_csnLow(dev);
-	spi_transfer(dev, W_REGISTER | (REGISTER_MASK & reg));
-	spi_write_byte(dev, value, len);
-	spi_csnHi(dev);
+	reg = reg & REGISTER_MASK;
+	if (isShadowed(reg)) dev->regs[reg] = value[0];
+	uint8_t * addr = shadowAddr(dev, reg);
+	if (addr) memcpy(addr, value, (len < 5) ? len : 5);
+	Nrf24_command(dev, W_REGISTER | reg, value, NULL, len);
 }
 
-// Sends a data package to the default address. Be sure to send the correct
-// amount of bytes as configured as payload on the receiver.
-void Nrf24_send(NRF24_t * dev, uint8_t * value)
+// Reloads the shadow copy of the configuration registers from the chip
+void Nrf24_syncRegisters(NRF24_t * dev)
+{
+	uint8_t buffer[5];
+	Nrf24_acquireBus(dev);
+	for (uint8_t reg=0;reg<32;reg++) {
+		if (isShadowed(reg) || shadowAddr(dev, reg)) {
+			// SETUP_AW comes before the address registers, so the width is known by then
+			Nrf24_readRegister(dev, reg, buffer, shadowAddr(dev, reg) ? Nrf24_getAddressWidth(dev) : 1);
+		}
+	}
+	Nrf24_releaseBus(dev);
+}
+
+// Compares the shadow copy with the chip.
+// Returns ESP_ERR_INVALID_STATE when any register has drifted (e.g. the chip was power cycled).
+// The shadow copy is left untouched, so Nrf24_syncRegisters can be used to accept the chip contents.
+esp_err_t Nrf24_verifyRegisters(NRF24_t * dev)
+{
+	esp_err_t ret = ESP_OK;
+	uint8_t buffer[5];
+	Nrf24_acquireBus(dev);
+	for (uint8_t reg=0;reg<32;reg++) {
+		uint8_t * addr = shadowAddr(dev, reg);
+		if (addr) {
+			uint8_t width = Nrf24_getAddressWidth(dev);
+			Nrf24_command(dev, R_REGISTER | reg, NULL, buffer, width);
+			if (memcmp(addr, buffer, width) != 0) {
+				ESP_LOGW(TAG, "Register 0x%02x drifted", reg);
+				ret = ESP_ERR_INVALID_STATE;
+			}
+		} else if (isShadowed(reg)) {
+			Nrf24_command(dev, R_REGISTER | reg, NULL, buffer, 1);
+			if (dev->regs[reg] != buffer[0]) {
+				ESP_LOGW(TAG, "Register 0x%02x drifted shadow=0x%02x chip=0x%02x", reg, dev->regs[reg], buffer[0]);
+				ret = ESP_ERR_INVALID_STATE;
+			}
+		}
+	}
+	Nrf24_releaseBus(dev);
+	return ret;
+}
+
+// Waits for the previous packet, then writes one payload with the given
+// command into an empty TX FIFO and starts transmission.
+static void Nrf24_sendPayload(NRF24_t * dev, uint8_t cmd, uint8_t * value, uint8_t len)
 {
 	uint8_t status;
-	status = Nrf24_getStatus(dev);
+	if (dev->irqTask) {
+		// The IRQ task clears TX_DS and MAX_RT, wait for its report instead
+		if (dev->PTX) xQueuePeek(dev->txQueue, &status, pdMS_TO_TICKS(100));
+		dev->PTX = 0;
+		xQueueReset(dev->txQueue);
+	}
 	while (dev->PTX) // Wait until last paket is send
 	{
-		status = Nrf24_getStatus(dev);
+		status = Nrf24_pollStatus(dev, (1 << TX_DS) | (1 << MAX_RT));
 		if ((status & ((1 << TX_DS)  | (1 << MAX_RT))))
 		{
 			dev->PTX = 0;
@@ -302,45 +1272,231 @@ void Nrf24_send(NRF24_t * dev, uint8_t * value)
 		}
 	}
 	Nrf24_ceLow(dev);
+	Nrf24_acquireBus(dev);
+	// W_TX_PAYLOAD_NO_ACK is ignored until EN_DYN_ACK is set
+	if (cmd == W_TX_PAYLOAD_NO_ACK && !(dev->regs[FEATURE] & (1 << EN_DYN_ACK))) Nrf24_enableNoAckFeature(dev);
 	Nrf24_powerUpTx(dev); // Set to transmitter mode , Power up
-	spi_csnLow(dev); // Pull down chip select
-	spi_transfer(dev, FLUSH_TX ); // Write cmd to flush tx fifo
-	spi_csnHi(dev); // Pull up chip select
-	spi_csnLow(dev); // Pull down chip select
-	spi_transfer(dev, W_TX_PAYLOAD ); // Write cmd to write payload
-	spi_write_byte(dev, value, dev->payload); // Write payload
-	spi_csnHi(dev); // Pull up chip select
+	Nrf24_command(dev, FLUSH_TX, NULL, NULL, 0); // Flush tx fifo
+	Nrf24_command(dev, cmd, value, NULL, len); // Write payload
+	dev->ackTx = (cmd == W_TX_PAYLOAD);
+	Nrf24_releaseBus(dev);
+	dev->txStart = esp_timer_get_time();
 	Nrf24_ceHi(dev); // Start transmission
 }
 
+// Sends a data package to the default address. Be sure to send the correct
+// amount of bytes as configured as payload on the receiver.
+void Nrf24_send(NRF24_t * dev, uint8_t * value)
+{
+	Nrf24_sendPayload(dev, W_TX_PAYLOAD, value, dev->payload);
+}
+
 
 // Sends payload without expecting an ACK from the receiver effectively turning off retransmission of failed payloads.
 // See Nrf24l01 "PTX Operation" flowchart in the datasheet.
-// NOTE: Make sure to call Nrf24_enableNoAckFeature() before calling this function.
 // Is useful when achieving maximum throughput without caring much about losses.
 void Nrf24_sendNoAck(NRF24_t * dev, uint8_t * value)
 {
-	uint8_t status;
-	status = Nrf24_getStatus(dev);
-	while (dev->PTX) // Wait until last paket is sent
-	{
+	Nrf24_sendPayload(dev, W_TX_PAYLOAD_NO_ACK, value, dev->payload);
+}
+
+// Sends len (1 - 32) bytes to the default address.
+// NOTE: Make sure to enable dynamic payloads on pipe 0 with Nrf24_enableDynamicPayloads()
+// and on the receiving pipe of the receiver.
+void Nrf24_sendDynamic(NRF24_t * dev, uint8_t * value, uint8_t len)
+{
+	if (len == 0 || len > mirf_MAX_PAYLOAD) return;
+	Nrf24_sendPayload(dev, W_TX_PAYLOAD, value, len);
+}
+
+// Sends len (1 - 32) bytes without expecting an ACK from the receiver.
+// NOTE: Make sure to call Nrf24_enableDynamicPayloads() before calling this function.
+void Nrf24_sendNoAckDynamic(NRF24_t * dev, uint8_t * value, uint8_t len)
+{
+	if (len == 0 || len > mirf_MAX_PAYLOAD) return;
+	Nrf24_sendPayload(dev, W_TX_PAYLOAD_NO_ACK, value, len);
+}
+
+// Sends one packet with or without an ACK request.
+// len is used when dynamic payload length is enabled on pipe 0, otherwise the configured payload width is sent.
+// A packet without ACK is sent once and never waits for retransmissions,
+// which suits loss-tolerant traffic next to reliable traffic on the same link.
+void Nrf24_sendPacket(NRF24_t * dev, uint8_t * value, uint8_t len, bool ack)
+{
+	uint8_t cmd = ack ? W_TX_PAYLOAD : W_TX_PAYLOAD_NO_ACK;
+	if (dev->regs[DYNPD] & (1 << DPL_P0)) {
+		if (len == 0 || len > mirf_MAX_PAYLOAD) return;
+		Nrf24_sendPayload(dev, cmd, value, len);
+	} else {
+		Nrf24_sendPayload(dev, cmd, value, dev->payload);
+	}
+}
+
+// Puts the chip into TX mode for streaming with an empty TX FIFO
+static void Nrf24_startStream(NRF24_t * dev)
+{
+	Nrf24_ceLow(dev);
+	Nrf24_acquireBus(dev);
+	Nrf24_powerUpTx(dev); // Set to transmitter mode , Power up
+	Nrf24_command(dev, FLUSH_TX, NULL, NULL, 0); // Flush tx fifo
+	Nrf24_releaseBus(dev);
+	dev->streaming = true;
+}
+
+static bool Nrf24_writeFastPayload(NRF24_t * dev, uint8_t cmd, uint8_t * value)
+{
+	if (!dev->streaming) Nrf24_startStream(dev);
+
+	uint8_t status = Nrf24_getStatus(dev);
+	int64_t start = esp_timer_get_time();
+	while (status & (1 << TX_FULL)) {
+		if (status & (1 << MAX_RT)) return false;
+		if (esp_timer_get_time() - start > TX_FULL_TIMEOUT * 1000) {
+			ESP_LOGE(TAG, "TX FIFO full timeout. status=0x%x", status);
+			return false;
+		}
 		status = Nrf24_getStatus(dev);
-		if ((status & ((1 << TX_DS)  | (1 << MAX_RT))))
-		{
-			dev->PTX = 0;
+	}
+	if (status & (1 << MAX_RT)) return false;
+
+	Nrf24_command(dev, cmd, value, NULL, dev->payload); // Write payload
+	Nrf24_ceHi(dev); // Start transmission
+	return true;
+}
+
+// Queues a payload in the TX FIFO without waiting for the previous packets.
+// CE is kept high, so the chip sends back to back while the FIFO has data.
+// Waits only while the 3-deep TX FIFO is full, at most TX_FULL_TIMEOUT ms.
+// Returns false on that timeout or when a packet reached MAX_RT. The FIFO is halted until
+// Nrf24_txStandBy() or Nrf24_flushTx() is called.
+bool Nrf24_writeFast(NRF24_t * dev, uint8_t * value)
+{
+	return Nrf24_writeFastPayload(dev, W_TX_PAYLOAD, value);
+}
+
+// Same as Nrf24_writeFast, but the payload is sent once without requesting an ACK
+bool Nrf24_writeFastNoAck(NRF24_t * dev, uint8_t * value)
+{
+	if (!(dev->regs[FEATURE] & (1 << EN_DYN_ACK))) Nrf24_enableNoAckFeature(dev);
+	return Nrf24_writeFastPayload(dev, W_TX_PAYLOAD_NO_ACK, value);
+}
+
+// Waits until the TX FIFO is empty, then returns the chip to listening.
+// Returns false when a packet reached MAX_RT or on timeout. Unsent packets are flushed.
+bool Nrf24_txStandBy(NRF24_t * dev, int timeout)
+{
+	bool ret = true;
+	TickType_t startTick = xTaskGetTickCount();
+	while (dev->streaming) {
+		uint8_t status = Nrf24_getStatus(dev);
+		if (status & (1 << MAX_RT)) {
+			ESP_LOGW(TAG, "Maximum number of TX retries interrupt");
+			ret = false;
+			break;
+		}
+		if (Nrf24_txFifoEmpty(dev)) break;
+		TickType_t diffTick = xTaskGetTickCount() - startTick;
+		if ( (diffTick * portTICK_PERIOD_MS) > timeout) {
+			ESP_LOGE(TAG, "TX FIFO timeout. status=0x%x", status);
+			ret = false;
 			break;
 		}
 	}
 	Nrf24_ceLow(dev);
-	Nrf24_powerUpTx(dev); // Set to transmitter mode , Power up
-	spi_csnLow(dev); // Pull down chip select
-	spi_transfer(dev, FLUSH_TX ); // Write cmd to flush tx fifo
-	spi_csnHi(dev); // Pull up chip select
-	spi_csnLow(dev); // Pull down chip select
-	spi_transfer(dev, W_TX_PAYLOAD_NO_ACK ); // Write cmd to write payload
-	spi_write_byte(dev, value, dev->payload); // Write payload
-	spi_csnHi(dev); // Pull up chip select
-	Nrf24_ceHi(dev); // Start transmission
+	Nrf24_flushTx(dev);
+	Nrf24_powerUpRx(dev);
+	return ret;
+}
+
+// Number of payloads left in a halted TX FIFO.
+// FIFO_STATUS only tells empty or full, so dummy payloads are queued until
+// TX_FULL is set. The caller flushes the FIFO afterwards.
+static uint8_t Nrf24_txFifoCount(NRF24_t * dev)
+{
+	if (Nrf24_txFifoEmpty(dev)) return 0;
+	uint8_t count = 3;
+	while (!(Nrf24_getStatus(dev) & (1 << TX_FULL))) {
+		Nrf24_command(dev, W_TX_PAYLOAD, NULL, NULL, dev->payload);
+		count--;
+	}
+	return count;
+}
+
+// Sends count payloads of dev->payload bytes stored back to back in data,
+// keeping the TX FIFO topped up so the chip never idles between packets.
+// When results is not NULL, the outcome of each packet is stored there.
+// A packet that reaches MAX_RT is dropped and the stream continues with the next one.
+// Busy-waits for the whole stream, but holds the SPI bus only while refilling the FIFO
+// or recovering from MAX_RT. Returns the number of acknowledged packets.
+int Nrf24_sendStream(NRF24_t * dev, uint8_t * data, size_t count, rf24_tx_result_e * results, int timeout)
+{
+	size_t written = 0; // Packets handed to the TX FIFO
+	size_t done = 0; // Packets with a known outcome
+	int acked = 0;
+	TickType_t startTick = xTaskGetTickCount();
+
+	if (results) {
+		for (size_t i=0;i<count;i++) results[i] = RF24_TX_PENDING;
+	}
+	// The bus is only held for each top-up and recovery, never while waiting
+	Nrf24_startStream(dev);
+	while (done < count) {
+		uint8_t status = Nrf24_getStatus(dev);
+
+		if (status & (1 << MAX_RT)) {
+			Nrf24_acquireBus(dev);
+			// The failed packet is at the head of the halted FIFO
+			size_t failed = written - Nrf24_txFifoCount(dev);
+			for (;done<failed;done++) {
+				Nrf24_streamResult(dev, results, done, RF24_TX_ACKED);
+				acked++;
+			}
+			Nrf24_streamResult(dev, results, failed, RF24_TX_MAX_RT);
+			Nrf24_flushTx(dev);
+			Nrf24_configRegister(dev, STATUS, (1 << TX_DS) | (1 << MAX_RT));
+			Nrf24_releaseBus(dev);
+			// Packets behind the failed one were flushed too, send them again
+			written = done = failed + 1;
+			continue;
+		}
+
+		if (status & (1 << TX_FULL)) {
+			// Exactly three packets are still queued
+			for (;done+3<written;done++) {
+				Nrf24_streamResult(dev, results, done, RF24_TX_ACKED);
+				acked++;
+			}
+		} else if (written < count) {
+			Nrf24_acquireBus(dev);
+			Nrf24_command(dev, W_TX_PAYLOAD, &data[written * dev->payload], NULL, dev->payload);
+			if (written++ == done) Nrf24_ceHi(dev);
+			Nrf24_releaseBus(dev);
+			continue;
+		}
+
+		if (written == count && Nrf24_txFifoEmpty(dev)) {
+			for (;done<written;done++) {
+				Nrf24_streamResult(dev, results, done, RF24_TX_ACKED);
+				acked++;
+			}
+			continue;
+		}
+
+		TickType_t diffTick = xTaskGetTickCount() - startTick;
+		if ( (diffTick * portTICK_PERIOD_MS) > timeout) {
+			ESP_LOGE(TAG, "Stream timeout. status=0x%x", status);
+			for (;done<count;done++) {
+				Nrf24_streamResult(dev, results, done, RF24_TX_TIMEOUT);
+			}
+			break;
+		}
+	}
+	Nrf24_ceLow(dev);
+	Nrf24_acquireBus(dev);
+	Nrf24_flushTx(dev);
+	Nrf24_powerUpRx(dev);
+	Nrf24_releaseBus(dev);
+	return acked;
 }
 
 // Test if chip is still sending.
@@ -349,8 +1505,15 @@ bool Nrf24_isSending(NRF24_t * dev) {
 	uint8_t status;
 	if (dev->PTX)
 	{
-		status = Nrf24_getStatus(dev);
+		if (dev->irqTask) {
+			if (xQueueReceive(dev->txQueue, &status, 0) != pdTRUE) return true;
+			Nrf24_recordTx(dev, (status & (1 << TX_DS)) ? RF24_TX_ACKED : RF24_TX_MAX_RT, -1, esp_timer_get_time() - dev->txStart);
+			Nrf24_powerUpRx(dev);
+			return false;
+		}
+		status = Nrf24_pollStatus(dev, (1 << TX_DS) | (1 << MAX_RT));
 		if ((status & ((1 << TX_DS)  | (1 << MAX_RT)))) {// if sending successful (TX_DS) or max retries exceded (MAX_RT).
+			Nrf24_recordTx(dev, (status & (1 << TX_DS)) ? RF24_TX_ACKED : RF24_TX_MAX_RT, -1, esp_timer_get_time() - dev->txStart);
 			Nrf24_powerUpRx(dev);
 			return false;
 		}
@@ -365,20 +1528,38 @@ bool Nrf24_isSending(NRF24_t * dev) {
 bool Nrf24_isSend(NRF24_t * dev, int timeout) {
 	uint8_t status;
 	TickType_t startTick = xTaskGetTickCount();
+	if (dev->PTX && dev->irqTask) {
+		// Sleep until the IRQ task reports TX_DS or MAX_RT
+		if (xQueueReceive(dev->txQueue, &status, pdMS_TO_TICKS(timeout)) != pdTRUE) {
+			ESP_LOGE(TAG, "IRQ timeout");
+			Nrf24_recordTx(dev, RF24_TX_TIMEOUT, 0, -1);
+			return false;
+		}
+		// The IRQ task took its time stamp when TX_DS or MAX_RT was raised
+		Nrf24_recordTx(dev, (status & (1 << TX_DS)) ? RF24_TX_ACKED : RF24_TX_MAX_RT, -1, dev->irqTime - dev->txStart);
+		Nrf24_powerUpRx(dev);
+		if (status & (1 << MAX_RT)) {
+			ESP_LOGW(TAG, "Maximum number of TX retries interrupt");
+			return false;
+		}
+		return true;
+	}
 	if (dev->PTX) {
 		while(1) {
-			status = Nrf24_getStatus(dev);
+			status = Nrf24_pollStatus(dev, (1 << TX_DS) | (1 << MAX_RT));
 			/*
 				if sending successful (TX_DS) or max retries exceded (MAX_RT).
 			*/
 
 			if (status & (1 << TX_DS)) { // Data Sent TX FIFO interrup
+				Nrf24_recordTx(dev, RF24_TX_ACKED, -1, dev->statusTime - dev->txStart);
 				Nrf24_powerUpRx(dev);
 				return true;
 			}
 
 			if (status & (1 << MAX_RT)) { // Maximum number of TX retries interrupt
 				ESP_LOGW(TAG, "Maximum number of TX retries interrupt");
+				Nrf24_recordTx(dev, RF24_TX_MAX_RT, -1, dev->statusTime - dev->txStart);
 				Nrf24_powerUpRx(dev);
 				return false;
 			}
@@ -389,6 +1570,7 @@ bool Nrf24_isSend(NRF24_t * dev, int timeout) {
 			TickType_t diffTick = xTaskGetTickCount() - startTick;
 			if ( (diffTick * portTICK_PERIOD_MS) > timeout) {
 				ESP_LOGE(TAG, "Status register timeout. status=0x%x", status);
+				Nrf24_recordTx(dev, RF24_TX_TIMEOUT, 0, -1);
 				return false;
 			}
 			vTaskDelay(1);
@@ -402,39 +1584,165 @@ bool Nrf24_isSend(NRF24_t * dev, int timeout) {
 // Can be called anytime after the call to Nrf24_init() and preferably only once.
 void Nrf24_enableNoAckFeature(NRF24_t * dev)
 {
-	uint8_t value;
+	uint8_t value = dev->regs[FEATURE];
+	value = value | (1 << EN_DYN_ACK);
+	Nrf24_configRegister(dev, FEATURE, value);
+}
 
-	Nrf24_readRegister(dev, FEATURE, &value, 1);
-	value = value | 1; 
+// Enables auto acknowledgement on the pipes set in the pipes bitmask (bit 0 = pipe 0)
+// and disables it on the others. The receiver acknowledges only on pipes with auto-ack,
+// and the transmitter expects ACKs (and retransmits) only with auto-ack on pipe 0.
+void Nrf24_setAutoAck(NRF24_t * dev, uint8_t pipes)
+{
+	Nrf24_configRegister(dev, EN_AA, pipes & 0x3F);
+}
+
+// Enables or disables auto acknowledgement on one pipe
+void Nrf24_setAutoAckPipe(NRF24_t * dev, uint8_t pipe, bool enable)
+{
+	if (pipe > 5) return;
+	uint8_t value = dev->regs[EN_AA];
+	if (enable) {
+		value = value | (1 << pipe);
+	} else {
+		value = value & ~(1 << pipe);
+	}
+	Nrf24_configRegister(dev, EN_AA, value);
+}
+
+// Returns the EN_AA bitmask
+uint8_t Nrf24_getAutoAck(NRF24_t * dev)
+{
+	return dev->regs[EN_AA];
+}
+
+// Enables dynamic payload length on the pipes set in the pipes bitmask (bit 0 = pipe 0)
+// and disables it on the others. Pass 0 to go back to fixed payloads.
+// Dynamic payload length needs auto acknowledgement on the pipe.
+// The transmitter needs it on pipe 0, where the ACK packets arrive.
+void Nrf24_enableDynamicPayloads(NRF24_t * dev, uint8_t pipes)
+{
+	uint8_t value = dev->regs[FEATURE];
+	if (pipes & 0x3F) {
+		value = value | (1 << EN_DPL);
+	} else {
+		value = value & ~(1 << EN_DPL);
+	}
+	Nrf24_acquireBus(dev);
 	Nrf24_configRegister(dev, FEATURE, value);
+	Nrf24_configRegister(dev, DYNPD, pipes & 0x3F);
+	Nrf24_releaseBus(dev);
+}
+
+// Enables payloads in ACK packets on both sides of the link.
+// ACK payloads need dynamic payload length, so it is enabled on all pipes.
+// Use Nrf24_sendDynamic() and Nrf24_getDataDynamic() / Nrf24_drainRx() afterwards.
+void Nrf24_enableAckPayload(NRF24_t * dev)
+{
+	uint8_t value = dev->regs[FEATURE];
+	value = value | (1 << EN_ACK_PAY) | (1 << EN_DPL);
+	Nrf24_acquireBus(dev);
+	Nrf24_configRegister(dev, FEATURE, value);
+	Nrf24_configRegister(dev, DYNPD, 0x3F);
+	Nrf24_releaseBus(dev);
+}
+
+// Preloads len (1 - 32) bytes that the receiver sends back in the ACK packet
+// of the next packet arriving on pipe. Up to 3 ACK payloads can be pending.
+// Returns ESP_ERR_NO_MEM when the TX FIFO was full and the payload was dropped.
+esp_err_t Nrf24_writeAckPayload(NRF24_t * dev, uint8_t pipe, uint8_t * value, uint8_t len)
+{
+	if (pipe > 5 || len == 0 || len > mirf_MAX_PAYLOAD) return ESP_ERR_INVALID_ARG;
+	uint8_t status = Nrf24_command(dev, W_ACK_PAYLOAD | pipe, value, NULL, len);
+	if (status & (1 << TX_FULL)) return ESP_ERR_NO_MEM;
+	return ESP_OK;
+}
+
+// True when the transmitter got an ACK payload with the last packet.
+// Call after Nrf24_isSend() has returned true.
+// Only a payload on pipe 0 after a packet sent with auto-ack counts; other packets stay for Nrf24_getData().
+bool Nrf24_isAckPayloadAvailable(NRF24_t * dev)
+{
+	if (!dev->ackTx) return false;
+	if (dev->irqTask) {
+		rf24_packet_t packet;
+		return xQueuePeek(dev->rxQueue, &packet, 0) == pdTRUE && packet.pipe == 0;
+	}
+	return ((Nrf24_getStatus(dev) >> RX_P_NO) & 0x07) == 0;
 }
 
+// Reads the ACK payload received by the transmitter into data and returns its length.
+uint8_t Nrf24_getAckPayload(NRF24_t * dev, uint8_t * data)
+{
+	return Nrf24_getDataDynamic(dev, data);
+}
 
+// Width of the payload at the head of the RX FIFO.
+// A width over 32 means a corrupted packet; the RX FIFO is flushed and 0 is returned.
+uint8_t Nrf24_getDynamicPayloadSize(NRF24_t * dev)
+{
+	uint8_t width;
+	Nrf24_command(dev, R_RX_PL_WID, NULL, &width, 1);
+	if (width > mirf_MAX_PAYLOAD) {
+		Nrf24_flushRx(dev);
+		Nrf24_configRegister(dev, STATUS, (1 << RX_DR));
+		return 0;
+	}
+	return width;
+}
 
+
+
+// STATUS is shifted out with every command, so a lone NOP is enough to read it
 uint8_t Nrf24_getStatus(NRF24_t * dev) {
-	uint8_t rv;
-	Nrf24_readRegister(dev, STATUS, &rv, 1);
-	return rv;
+	return Nrf24_command(dev, NOP, NULL, NULL, 0);
+}
+
+// Microseconds since dev->status was last captured from the chip
+int64_t Nrf24_getStatusAge(NRF24_t * dev) {
+	return esp_timer_get_time() - dev->statusTime;
+}
+
+// Returns the cached STATUS when it is at most maxAge microseconds old,
+// otherwise reads it from the chip.
+uint8_t Nrf24_getCachedStatus(NRF24_t * dev, int64_t maxAge) {
+	if (Nrf24_getStatusAge(dev) <= maxAge) return dev->status;
+	return Nrf24_getStatus(dev);
+}
+
+// RX_DR, TX_DS and MAX_RT stay set until the host clears them, so once one
+// of the flags in mask is set in the cached STATUS it is still set in the chip.
+// Reads STATUS from the chip only when none of them is set yet.
+uint8_t Nrf24_pollStatus(NRF24_t * dev, uint8_t mask) {
+	if (dev->status & mask) return dev->status;
+	return Nrf24_getStatus(dev);
 }
 
 void Nrf24_powerUpRx(NRF24_t * dev) {
 	dev->PTX = 0;
+	dev->streaming = false;
 	Nrf24_ceLow(dev);
-	Nrf24_configRegister(dev, CONFIG, mirf_CONFIG | ( (1 << PWR_UP) | (1 << PRIM_RX) ) ); //set device as RX mode
+	Nrf24_configRegister(dev, CONFIG, dev->config | ( (1 << PWR_UP) | (1 << PRIM_RX) ) ); //set device as RX mode
 	Nrf24_ceHi(dev);
 	Nrf24_configRegister(dev, STATUS, (1 << TX_DS) | (1 << MAX_RT)); //Clear seeded interrupt and max tx number interrupt
+	// Flags left for the streaming code keep IRQ low without a new edge
+	if (dev->irqTask && gpio_get_level(dev->irqPin) == 0) xTaskNotifyGive(dev->irqTask);
 }
 
 void Nrf24_flushRx(NRF24_t * dev)
 {
-	spi_csnLow(dev);
-	spi_transfer(dev, FLUSH_RX );
-	spi_csnHi(dev);
+	Nrf24_command(dev, FLUSH_RX, NULL, NULL, 0);
+}
+
+void Nrf24_flushTx(NRF24_t * dev)
+{
+	Nrf24_command(dev, FLUSH_TX, NULL, NULL, 0);
 }
 
 void Nrf24_powerUpTx(NRF24_t * dev) {
 	dev->PTX = 1;
-	Nrf24_configRegister(dev, CONFIG, mirf_CONFIG | ( (1 << PWR_UP) | (0 << PRIM_RX) ) ); //set device as TX mode
+	dev->streaming = false;
+	Nrf24_configRegister(dev, CONFIG, dev->config | ( (1 << PWR_UP) | (0 << PRIM_RX) ) ); //set device as TX mode
 	Nrf24_configRegister(dev, STATUS, (1 << TX_DS) | (1 << MAX_RT)); //Clear seeded interrupt and max tx number interrupt
 }
 
@@ -448,8 +1756,9 @@ void Nrf24_ceLow(NRF24_t * dev) {
 
 void Nrf24_powerDown(NRF24_t * dev)
 {
+	dev->streaming = false;
 	Nrf24_ceLow(dev);
-	Nrf24_configRegister(dev, CONFIG, mirf_CONFIG );
+	Nrf24_configRegister(dev, CONFIG, dev->config );
 }
 
 //Set tx power : 0=-18dBm,1=-12dBm,2=-6dBm,3=0dBm
@@ -457,8 +1766,7 @@ void Nrf24_SetOutputRF_PWR(NRF24_t * dev, uint8_t val)
 {
 	if (val > 3) return;
 
-	uint8_t value;
-	Nrf24_readRegister(dev, RF_SETUP, &value, 1);
+	uint8_t value = dev->regs[RF_SETUP];
 	value = value & 0xF9;
 	value = value | (val<< RF_PWR);
 	//Nrf24_configRegister(dev, RF_SETUP,	(val<< RF_PWR) );
@@ -470,8 +1778,7 @@ void Nrf24_SetSpeedDataRates(NRF24_t * dev, uint8_t val)
 {
 	if (val > 2) return;
 
-	uint8_t value;
-	Nrf24_readRegister(dev, RF_SETUP, &value, 1);
+	uint8_t value = dev->regs[RF_SETUP];
 	if(val == 2)
 	{
 		value = value | 0x20;
@@ -491,8 +1798,7 @@ void Nrf24_SetSpeedDataRates(NRF24_t * dev, uint8_t val)
 //Set Auto Retransmit Delay 0=250us, 1=500us, ... 15=4000us
 void Nrf24_setRetransmitDelay(NRF24_t * dev, uint8_t val)
 {
-	uint8_t value;
-	Nrf24_readRegister(dev, SETUP_RETR, &value, 1);
+	uint8_t value = dev->regs[SETUP_RETR];
 	value = value & 0x0F;
 	value = value | (val << ARD);
 	Nrf24_configRegister(dev, SETUP_RETR, value);
@@ -500,26 +1806,84 @@ void Nrf24_setRetransmitDelay(NRF24_t * dev, uint8_t val)
 
 void Nrf24_setRetransmitCount(NRF24_t * dev, uint8_t val)
 {
-	uint8_t value;
-	Nrf24_readRegister(dev, SETUP_RETR, &value, 1);
+	uint8_t value = dev->regs[SETUP_RETR];
 	value = value & 0xF0;
 	value = value | val;
 	Nrf24_configRegister(dev, SETUP_RETR, value);
 }
 
+// Sets the CRC length. The chip forces CRC on while any pipe has auto-ack enabled,
+// so RF24_CRC_DISABLED returns ESP_ERR_INVALID_STATE, changing nothing, unless EN_AA is cleared first.
+esp_err_t Nrf24_setCRCLength(NRF24_t * dev, rf24_crclength_e length)
+{
+	uint8_t config = dev->config & ~((1 << EN_CRC) | (1 << CRCO));
+	if (length == RF24_CRC_8) {
+		config = config | (1 << EN_CRC);
+	} else if (length == RF24_CRC_16) {
+		config = config | (1 << EN_CRC) | (1 << CRCO);
+	} else if (length != RF24_CRC_DISABLED) {
+		return ESP_ERR_INVALID_ARG;
+	}
+	if (length == RF24_CRC_DISABLED && dev->regs[EN_AA]) return ESP_ERR_INVALID_STATE;
+	// Kept in dev->config so that powerUpRx/powerUpTx do not undo it
+	dev->config = config;
+	Nrf24_configRegister(dev, CONFIG, dev->config | (dev->regs[CONFIG] & ((1 << PWR_UP) | (1 << PRIM_RX))));
+	return ESP_OK;
+}
+
+// Raw throughput profile: no auto-ack, no retransmits and no CRC.
+// Every packet is sent exactly once and corrupted packets are delivered,
+// so the application must check the data itself, e.g. with Nrf24_crc16().
+// Both sides must use the profile.
+void Nrf24_setRawProfile(NRF24_t * dev)
+{
+	Nrf24_acquireBus(dev);
+	Nrf24_configRegister(dev, EN_AA, 0x00);
+	Nrf24_setRetransmitCount(dev, 0);
+	Nrf24_setCRCLength(dev, RF24_CRC_DISABLED);
+	Nrf24_releaseBus(dev);
+}
+
+// CRC-16-CCITT (polynomial 0x1021, initial 0xFFFF), the same CRC the chip uses
+uint16_t Nrf24_crc16(const uint8_t * data, size_t len)
+{
+	uint16_t crc = 0xFFFF;
+	while (len--) {
+		crc = crc ^ ((uint16_t)*data++ << 8);
+		for (int i=0;i<8;i++) {
+			crc = (crc & 0x8000) ? (crc << 1) ^ 0x1021 : (crc << 1);
+		}
+	}
+	return crc;
+}
+
+// Sets the address width of all pipes to 3, 4 or 5 bytes.
+// Shorter addresses save airtime but make noise more likely to match.
+// Set it on both sides before setting the addresses.
+esp_err_t Nrf24_setAddressWidth(NRF24_t * dev, uint8_t width)
+{
+	if (width < 3 || width > mirf_ADDR_LEN) return ESP_ERR_INVALID_ARG;
+	Nrf24_configRegister(dev, SETUP_AW, width - 2);
+	return ESP_OK;
+}
+
 
 
 void Nrf24_printDetails(NRF24_t * dev)
 {
+	Nrf24_acquireBus(dev);
 
 	printf("================ SPI Configuration ================\n" );
-	printf("CSN Pin  \t = GPIO%d\n",dev->csnPin);
+	printf("CSN Pin  \t = GPIO%d (%s)\n",dev->csnPin, dev->csnHw ? "Hardware" : "Software");
 	printf("CE Pin	\t = GPIO%d\n", dev->cePin);
-	printf("Clock Speed\t = %d\n", SPI_Frequency);
+	printf("SPI Host\t = SPI%d_HOST\n", dev->host + 1);
+	printf("Clock Speed\t = %d\n", dev->clockSpeed);
+	printf("SPI Mode\t = %s\n", dev->polling ? "Polling" : "Interrupt");
 	printf("================ NRF Configuration ================\n");
 
 	Nrf24_print_status(Nrf24_getStatus(dev));
 
+	printf("Address Width\t = %d bytes\n", Nrf24_getAddressWidth(dev));
 	Nrf24_print_address_register(dev, "RX_ADDR_P0-1", RX_ADDR_P0, 2);
 	Nrf24_print_byte_register(dev, "RX_ADDR_P2-5", RX_ADDR_P2, 4);
 	Nrf24_print_address_register(dev, "TX_ADDR\t", TX_ADDR, 1);
@@ -545,6 +1909,7 @@ void Nrf24_printDetails(NRF24_t * dev)
 	uint8_t retransmit = Nrf24_getRetransmitDelay(dev);
 	int16_t delay = (retransmit+1)*250;
 	printf("Retransmit\t = %d us\n", delay);
+	Nrf24_releaseBus(dev);
 }
 
 #define _BV(x) (1<<(x))
@@ -559,9 +1924,9 @@ void Nrf24_print_address_register(NRF24_t * dev, const char* name, uint8_t reg,
 {
 	printf("%s\t =",name);
 	while (qty--) {
-		//uint8_t buffer[addr_width];
+		uint8_t width = Nrf24_getAddressWidth(dev);
 		uint8_t buffer[5];
-		Nrf24_readRegister(dev, reg++, buffer, sizeof(buffer));
+		Nrf24_readRegister(dev, reg++, buffer, width);
 
 		printf(" 0x");
 #if 0
@@ -570,7 +1935,7 @@ void Nrf24_print_address_register(NRF24_t * dev, const char* name, uint8_t reg,
 			printf("%02x", *bufptr);
 		}
 #endif
-		for(int i=0;i<5;i++) {
+		for(int i=0;i<width;i++) {
 			printf("%02x", buffer[i]);
 		}
 	}
@@ -591,8 +1956,7 @@ void Nrf24_print_byte_register(NRF24_t * dev, const char* name, uint8_t reg, uin
 uint8_t Nrf24_getDataRate(NRF24_t * dev)
 {
 	rf24_datarate_e result;
-	uint8_t dr;
-	Nrf24_readRegister(dev, RF_SETUP, &dr, sizeof(dr));
+	uint8_t dr = dev->regs[RF_SETUP];
 	//printf("RF_SETUP=%x\n",dr);
 	dr = dr & (_BV(RF_DR_LOW) | _BV(RF_DR_HIGH));
 
@@ -620,12 +1984,10 @@ uint8_t Nrf24_getCRCLength(NRF24_t * dev)
 {
 	rf24_crclength_e result = RF24_CRC_DISABLED;
 
-	uint8_t config;
-	Nrf24_readRegister(dev, CONFIG, &config, sizeof(config));
+	uint8_t config = dev->regs[CONFIG];
 	//printf("CONFIG=%x\n",config);
 	config = config & (_BV(CRCO) | _BV(EN_CRC));
-	uint8_t AA;
-	Nrf24_readRegister(dev, EN_AA, &AA, sizeof(AA));
+	uint8_t AA = dev->regs[EN_AA];
 
 	if (config & _BV(EN_CRC) || AA) {
 		if (config & _BV(CRCO)) {
@@ -640,8 +2002,7 @@ uint8_t Nrf24_getCRCLength(NRF24_t * dev)
 
 uint8_t Nrf24_getPALevel(NRF24_t * dev)
 {
-	uint8_t level;
-	Nrf24_readRegister(dev, RF_SETUP, &level, sizeof(level));
+	uint8_t level = dev->regs[RF_SETUP];
 	//printf("RF_SETUP=%x\n",level);
 	level = (level & (_BV(RF_PWR_LOW) | _BV(RF_PWR_HIGH))) >> 1;
 	return (level);
@@ -654,18 +2015,25 @@ char * Nrf24_getPALevelString(NRF24_t * dev)
 
 uint8_t Nrf24_getRetransmitDelay(NRF24_t * dev)
 {
-	uint8_t value;
-	Nrf24_readRegister(dev, SETUP_RETR, &value, 1);
+	uint8_t value = dev->regs[SETUP_RETR];
 	return (value >> 4);
 }
 
 uint8_t Nrf24_getRetransmitCount(NRF24_t * dev)
 {
-	uint8_t value;
-	Nrf24_readRegister(dev, SETUP_RETR, &value, 1);
+	uint8_t value = dev->regs[SETUP_RETR];
 	return (value & 0x0F);
 }
 
+// Returns the address width in bytes
+uint8_t Nrf24_getAddressWidth(NRF24_t * dev)
+{
+	uint8_t value = dev->regs[SETUP_AW] & 0x03;
+	// 00 is illegal, the chip resets to 11 (5 bytes)
+	if (value == 0) return mirf_ADDR_LEN;
+	return value + 2;
+}
+
 
 uint8_t Nrf24_getChannle(NRF24_t * dev)
 {
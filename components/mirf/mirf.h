@@ -1,20 +1,104 @@
 #ifndef MAIN_MIRF_H_
 #define MAIN_MIRF_H_
 
+#include "freertos/FreeRTOS.h"
+#include "freertos/queue.h"
+#include "freertos/semphr.h"
+#include "freertos/task.h"
 #include "driver/spi_master.h"
 
 #ifdef __cplusplus
 extern "C" {
 #endif
 
+/**
+ * Outcome of a transmitted packet.
+ *
+ * For use with Nrf24_sendStream() and Nrf24_sendAsync()
+ */
+typedef enum {
+    RF24_TX_PENDING = 0,
+    RF24_TX_ACKED,
+    RF24_TX_MAX_RT,
+    RF24_TX_TIMEOUT
+} rf24_tx_result_e;
+
+/**
+ * Completion report of an asynchronous send.
+ *
+ * For use with Nrf24_sendAsync()
+ */
+typedef struct {
+    uint32_t handle;// Handle returned by Nrf24_sendAsync().
+    rf24_tx_result_e result;// RF24_TX_ACKED, RF24_TX_MAX_RT or RF24_TX_TIMEOUT when neither was raised in time.
+    uint8_t retries;// ARC_CNT from OBSERVE_TX.
+    int64_t latency;// Microseconds from submission to completion.
+} rf24_tx_report_t;
+
+typedef void (*rf24_tx_callback_t)(const rf24_tx_report_t * report, void * arg);
+
+/**
+ * Pins, SPI host and SPI options of one device.
+ *
+ * For use with Nrf24_initWithConfig()
+ */
+typedef struct {
+    int misoPin;
+    int mosiPin;
+    int sclkPin;
+    int cePin;
+    int csnPin;
+    spi_host_device_t host;// Devices on the same host share the bus.
+    int clockSpeed;// SPI clock in Hz.
+    int queueSize;// SPI transaction queue depth.
+    bool csnHw;// Let the SPI peripheral drive CSN.
+    bool polling;// Use polling SPI transactions.
+} NRF24_config_t;
+
 typedef struct {
     uint8_t PTX;  //In sending mode.
+    bool ackTx;// The last packet went out with auto-ack, so pipe 0 carries its ACK payload.
     uint8_t cePin;// CE Pin controls RX / TX, default 8.
     uint8_t csnPin;//CSN Pin Chip Select Not, default 7.
     uint8_t channel;//Channel 0 - 127 or 0 - 84 in the US.
     uint8_t payload;// Payload width in bytes default 16 max 32.
     spi_device_handle_t _SPIHandle;
-    uint8_t status;// Receive status
+    spi_host_device_t host;// SPI host the device is on.
+    int clockSpeed;// SPI clock in Hz.
+    int queueSize;// SPI transaction queue depth.
+    uint8_t status;// STATUS captured by the last command.
+    int64_t statusTime;// esp_timer time when status was captured.
+    bool polling;// Use polling SPI transactions.
+    uint8_t busDepth;// Nesting depth of Nrf24_acquireBus.
+    bool csnHw;// CSN is driven by the SPI peripheral.
+    uint8_t regs[0x1E];// Shadow copy of the configuration registers.
+    uint8_t addr[3][5];// Shadow copy of RX_ADDR_P0, RX_ADDR_P1 and TX_ADDR.
+    bool streaming;// TX FIFO is being streamed with CE held high.
+    uint8_t config;// CONFIG bits other than PWR_UP and PRIM_RX.
+    SemaphoreHandle_t lock;// Serializes chip access once the IRQ task runs.
+    int irqPin;// IRQ GPIO, -1 when polling.
+    TaskHandle_t irqTask;// Task servicing the IRQ pin.
+    volatile bool irqStop;// Asks the IRQ task to exit, cleared when it has.
+    QueueHandle_t rxQueue;// rf24_packet_t received by the IRQ task.
+    QueueHandle_t txQueue;// STATUS of the last finished transmission.
+    volatile int64_t irqTime;// esp_timer time of the last IRQ.
+    uint32_t rxDropped;// Packets dropped because rxQueue was full.
+    QueueHandle_t asyncQueue;// Packets waiting for Nrf24_sendAsync.
+    QueueHandle_t txReports;// rf24_tx_report_t when there is no callback.
+    rf24_tx_callback_t txCallback;// Called from the IRQ task on completion.
+    void * txCallbackArg;
+    uint32_t asyncNext;// Next handle for Nrf24_sendAsync.
+    uint32_t asyncHandle;// Handle of the packet in the air, 0 when idle.
+    int64_t asyncStart;// esp_timer time the packet was submitted.
+    int64_t asyncDeadline;// esp_timer time the packet in the air times out.
+    uint8_t * dmaTx;// DMA buffers for commands with data.
+    uint8_t * dmaRx;
+    uint8_t * poolBase;// Payload slots lent by Nrf24_allocPayload.
+    uint16_t poolCount;
+    QueueHandle_t poolFree;// Payloads not lent out.
+    struct NRF24_dedup_s * dedup;// Duplicate filter, see mirf_dedup.h.
+    struct NRF24_stats_s * stats;// Link statistics, see mirf_stats.h.
+    int64_t txStart;// esp_timer time the last blocking send started.
 } NRF24_t;
 
 /* Memory Map */
@@ -94,6 +178,8 @@ typedef struct {
 #define W_TX_PAYLOAD  0xA0
 #define FLUSH_TX      0xE1
 #define FLUSH_RX      0xE2
+#define R_RX_PL_WID   0x60
+#define W_ACK_PAYLOAD 0xA8
 #define REUSE_TX_PL   0xE3
 #define NOP           0xFF
 
@@ -109,9 +195,24 @@ typedef struct {
 #define RF_DR_HIGH  3
 #define RF_PWR_LOW  1
 #define RF_PWR_HIGH 2
+#define DPL_P5      5
+#define DPL_P4      4
+#define DPL_P3      3
+#define DPL_P2      2
+#define DPL_P1      1
+#define DPL_P0      0
+#define EN_DPL      2
+#define EN_ACK_PAY  1
+#define EN_DYN_ACK  0
 
 /* Device addrees length:3~5 bytes */
-#define mirf_ADDR_LEN    5
+#define mirf_ADDR_LEN    5 // Maximum, see Nrf24_setAddressWidth
+
+/* Maximum payload length */
+#define mirf_MAX_PAYLOAD 32
+
+/* DMA buffer: command byte, payload, padded to a word */
+#define MIRF_SLOT_SIZE 36
 
 /* 
  enable interrupt caused by RX_DR.
@@ -167,17 +268,59 @@ typedef enum {
 } rf24_crclength_e;
 
 
+/**
+ * A received payload with its metadata.
+ *
+ * For use with Nrf24_drainRx()
+ */
+typedef struct {
+    uint8_t pipe;// Data pipe the payload arrived on.
+    uint8_t length;// Payload length in bytes.
+    int64_t timestamp;// esp_timer time the payload was read.
+    uint8_t data[mirf_MAX_PAYLOAD];
+} rf24_packet_t;
+
+
 void      Nrf24_init(NRF24_t * dev);
+void      Nrf24_getDefaultConfig(NRF24_config_t * config);
+esp_err_t Nrf24_initWithConfig(NRF24_t * dev, const NRF24_config_t * config);
 void      Nrf24_deinit(NRF24_t *dev);
 bool      spi_write_byte(NRF24_t * dev, uint8_t* Dataout, size_t DataLength );
 bool      spi_read_byte(NRF24_t * dev, uint8_t* Datain, uint8_t* Dataout, size_t DataLength );
 uint8_t   spi_transfer(NRF24_t * dev, uint8_t address);
 void      spi_csnLow(NRF24_t * dev);
 void      spi_csnHi(NRF24_t * dev);
+void      Nrf24_acquireBus(NRF24_t * dev);
+void      Nrf24_releaseBus(NRF24_t * dev);
+void      Nrf24_setPollingMode(NRF24_t * dev, bool polling);
+esp_err_t Nrf24_setClockSpeed(NRF24_t * dev, int clockSpeed);
+int       Nrf24_trainClock(NRF24_t * dev, int maxClock);
+uint8_t   Nrf24_command(NRF24_t * dev, uint8_t cmd, const uint8_t * dataout, uint8_t * datain, uint8_t len);
+esp_err_t Nrf24_createPool(NRF24_t * dev, uint16_t count);
+void      Nrf24_deletePool(NRF24_t * dev);
+bool      Nrf24_isPoolPayload(NRF24_t * dev, const uint8_t * payload);
+uint8_t * Nrf24_allocPayload(NRF24_t * dev, int timeout);
+void      Nrf24_freePayload(NRF24_t * dev, uint8_t * payload);
 void      Nrf24_config(NRF24_t * dev, uint8_t channel, uint8_t payload);
 void      Nrf24_send(NRF24_t * dev, uint8_t *value);
 void      Nrf24_enableNoAckFeature(NRF24_t * dev);
+void      Nrf24_setAutoAck(NRF24_t * dev, uint8_t pipes);
+void      Nrf24_setAutoAckPipe(NRF24_t * dev, uint8_t pipe, bool enable);
+uint8_t   Nrf24_getAutoAck(NRF24_t * dev);
 void      Nrf24_sendNoAck(NRF24_t * dev, uint8_t *value);
+void      Nrf24_sendDynamic(NRF24_t * dev, uint8_t * value, uint8_t len);
+void      Nrf24_sendNoAckDynamic(NRF24_t * dev, uint8_t * value, uint8_t len);
+void      Nrf24_sendPacket(NRF24_t * dev, uint8_t * value, uint8_t len, bool ack);
+void      Nrf24_enableDynamicPayloads(NRF24_t * dev, uint8_t pipes);
+uint8_t   Nrf24_getDynamicPayloadSize(NRF24_t * dev);
+void      Nrf24_enableAckPayload(NRF24_t * dev);
+esp_err_t Nrf24_writeAckPayload(NRF24_t * dev, uint8_t pipe, uint8_t * value, uint8_t len);
+bool      Nrf24_isAckPayloadAvailable(NRF24_t * dev);
+uint8_t   Nrf24_getAckPayload(NRF24_t * dev, uint8_t * data);
+bool      Nrf24_writeFast(NRF24_t * dev, uint8_t * value);
+bool      Nrf24_writeFastNoAck(NRF24_t * dev, uint8_t * value);
+bool      Nrf24_txStandBy(NRF24_t * dev, int timeout);
+int       Nrf24_sendStream(NRF24_t * dev, uint8_t * data, size_t count, rf24_tx_result_e * results, int timeout);
 esp_err_t Nrf24_setRADDR(NRF24_t * dev, uint8_t * adr);
 esp_err_t Nrf24_setTADDR(NRF24_t * dev, uint8_t * adr);
 void      Nrf24_addRADDR(NRF24_t * dev, uint8_t pipe, uint8_t adr);
@@ -188,10 +331,24 @@ bool      Nrf24_isSend(NRF24_t * dev, int timeout);
 bool      Nrf24_rxFifoEmpty(NRF24_t * dev);
 bool      Nrf24_txFifoEmpty(NRF24_t * dev);
 void      Nrf24_getData(NRF24_t * dev, uint8_t * data);
+uint8_t   Nrf24_getDataDynamic(NRF24_t * dev, uint8_t * data);
+uint8_t * Nrf24_receivePayload(NRF24_t * dev, uint8_t * pipe, uint8_t * len);
+uint8_t   Nrf24_drainRx(NRF24_t * dev, rf24_packet_t * packets, uint8_t max);
+esp_err_t Nrf24_enableIrq(NRF24_t * dev, int irqPin, UBaseType_t rxQueueLength);
+void      Nrf24_disableIrq(NRF24_t * dev);
+bool      Nrf24_waitData(NRF24_t * dev, rf24_packet_t * packet, int timeout);
+esp_err_t Nrf24_enableAsync(NRF24_t * dev, UBaseType_t depth, rf24_tx_callback_t callback, void * arg);
+esp_err_t Nrf24_sendAsync(NRF24_t * dev, uint8_t * value, uint8_t len, uint32_t * handle);
+bool      Nrf24_getTxReport(NRF24_t * dev, rf24_tx_report_t * report, int timeout);
 uint8_t   Nrf24_getStatus(NRF24_t * dev);
+int64_t   Nrf24_getStatusAge(NRF24_t * dev);
+uint8_t   Nrf24_getCachedStatus(NRF24_t * dev, int64_t maxAge);
+uint8_t   Nrf24_pollStatus(NRF24_t * dev, uint8_t mask);
 void      Nrf24_configRegister(NRF24_t * dev, uint8_t reg, uint8_t value);
 void      Nrf24_readRegister(NRF24_t * dev, uint8_t reg, uint8_t * value, uint8_t len);
 void      Nrf24_writeRegister(NRF24_t * dev, uint8_t reg, uint8_t * value, uint8_t len);
+void      Nrf24_syncRegisters(NRF24_t * dev);
+esp_err_t Nrf24_verifyRegisters(NRF24_t * dev);
 void      Nrf24_powerUpRx(NRF24_t * dev);
 void      Nrf24_powerUpTx(NRF24_t * dev);
 void      Nrf24_powerDown(NRF24_t * dev);
@@ -199,9 +356,14 @@ void      Nrf24_SetOutputRF_PWR(NRF24_t * dev, uint8_t val);
 void      Nrf24_SetSpeedDataRates(NRF24_t * dev, uint8_t val);
 void      Nrf24_setRetransmitDelay(NRF24_t * dev, uint8_t val);
 void      Nrf24_setRetransmitCount(NRF24_t * dev, uint8_t val);
+esp_err_t Nrf24_setCRCLength(NRF24_t * dev, rf24_crclength_e length);
+void      Nrf24_setRawProfile(NRF24_t * dev);
+uint16_t  Nrf24_crc16(const uint8_t * data, size_t len);
+esp_err_t Nrf24_setAddressWidth(NRF24_t * dev, uint8_t width);
 void      Nrf24_ceHi(NRF24_t * dev);
 void      Nrf24_ceLow(NRF24_t * dev);
 void      Nrf24_flushRx(NRF24_t * dev);
+void      Nrf24_flushTx(NRF24_t * dev);
 void      Nrf24_printDetails(NRF24_t * dev);
 void      Nrf24_print_status(uint8_t status);
 void      Nrf24_print_address_register(NRF24_t * dev, const char* name, uint8_t reg, uint8_t qty);
@@ -213,6 +375,7 @@ uint8_t   Nrf24_getPALevel(NRF24_t * dev);
 char *    Nrf24_getPALevelString(NRF24_t * dev);
 uint8_t   Nrf24_getRetransmitDelay(NRF24_t * dev);
 uint8_t   Nrf24_getRetransmitCount(NRF24_t * dev);
+uint8_t   Nrf24_getAddressWidth(NRF24_t * dev);
 uint8_t   Nrf24_getChannle(NRF24_t * dev);
 uint8_t   Nrf24_getPayload(NRF24_t * dev);
 
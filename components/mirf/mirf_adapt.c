@@ -0,0 +1,225 @@
+#include <string.h>
+
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "esp_log.h"
+#include "esp_timer.h"
+
+#include "mirf_adapt.h"
+
+#define TAG "ADAPT"
+
+#define ADAPT_SEND_TIMEOUT 100 // ms
+#define ADAPT_PROBE_TRIES 4
+#define ADAPT_MAX_HOLD 64 // windows
+
+// 250Kbps needs ARD of 500us or more, 1500us with a full ACK payload
+static const rf24_adapt_profile_t adapt_defaultProfiles[] = {
+	{ RF24_250KBPS, RF24_PA_MAX, 5 },
+	{ RF24_1MBPS, RF24_PA_MAX, 2 },
+	{ RF24_2MBPS, RF24_PA_MAX, 1 },
+	{ RF24_2MBPS, RF24_PA_HIGH, 1 },
+	{ RF24_2MBPS, RF24_PA_LOW, 1 },
+};
+
+static void adapt_resetWindow(NRF24_adapt_t * adapt)
+{
+	adapt->sends = 0;
+	adapt->failures = 0;
+	adapt->retries = 0;
+}
+
+// Writes RF_SETUP and SETUP_RETR in standby
+static void adapt_apply(NRF24_adapt_t * adapt, uint8_t profile)
+{
+	NRF24_t * dev = adapt->dev;
+	const rf24_adapt_profile_t * p = &adapt->profiles[profile];
+	Nrf24_ceLow(dev);
+	Nrf24_SetSpeedDataRates(dev, p->dataRate);
+	Nrf24_SetOutputRF_PWR(dev, p->paLevel);
+	Nrf24_setRetransmitDelay(dev, p->retransmitDelay);
+	if (!dev->PTX) Nrf24_ceHi(dev);
+	adapt->profile = profile;
+	adapt_resetWindow(adapt);
+}
+
+static void adapt_fallback(NRF24_adapt_t * adapt)
+{
+	ESP_LOGW(TAG, "link lost at profile %d", adapt->profile);
+	adapt_apply(adapt, 0);
+	adapt->cleanWindows = 0;
+	adapt->fallbacks++;
+}
+
+// Sends with ACK and returns ARC_CNT through retries
+static bool adapt_transmit(NRF24_adapt_t * adapt, uint8_t * value, uint8_t len, uint8_t * retries)
+{
+	NRF24_t * dev = adapt->dev;
+	Nrf24_sendPacket(dev, value, len, true);
+	bool acked = Nrf24_isSend(dev, ADAPT_SEND_TIMEOUT);
+	uint8_t observe;
+	Nrf24_readRegister(dev, OBSERVE_TX, &observe, 1);
+	*retries = (observe >> ARC_CNT) & 0x0F;
+	int64_t now = esp_timer_get_time();
+	adapt->lastTx = now;
+	if (acked) {
+		adapt->lastRx = now;
+		adapt->failuresInRow = 0;
+	} else {
+		adapt->failuresInRow++;
+	}
+	return acked;
+}
+
+static bool adapt_control(NRF24_adapt_t * adapt, uint8_t cmd, uint8_t profile)
+{
+	uint8_t buf[mirf_MAX_PAYLOAD];
+	uint8_t retries;
+	memset(buf, 0, sizeof(buf));
+	memcpy(buf, ADAPT_MAGIC, ADAPT_MAGIC_LENGTH);
+	buf[ADAPT_MAGIC_LENGTH] = cmd;
+	buf[ADAPT_MAGIC_LENGTH + 1] = profile;
+	return adapt_transmit(adapt, buf, ADAPT_CONTROL_LENGTH, &retries);
+}
+
+// Probes a few times, the slave may not have read ADAPT_SET yet
+static bool adapt_probe(NRF24_adapt_t * adapt, uint8_t profile)
+{
+	adapt_apply(adapt, profile);
+	for (int i=0;i<ADAPT_PROBE_TRIES;i++) {
+		if (adapt_control(adapt, ADAPT_PROBE, profile)) return true;
+		vTaskDelay(1);
+	}
+	return false;
+}
+
+// Master: moves both peers to target.
+// A lost ACK leaves it open whether the slave switched, so both profiles are probed,
+// the likely one first. Returns true when the link runs on target.
+static bool adapt_switch(NRF24_adapt_t * adapt, uint8_t target)
+{
+	uint8_t from = adapt->profile;
+	bool setAcked = adapt_control(adapt, ADAPT_SET, target);
+	uint8_t first = setAcked ? target : from;
+	uint8_t second = setAcked ? from : target;
+	if (adapt_probe(adapt, first)) return first == target;
+	if (adapt_probe(adapt, second)) return second == target;
+	// The slave returns to profile 0 after silence ms
+	adapt_fallback(adapt);
+	return false;
+}
+
+// Master: judges a full window and steps along the ladder
+static void adapt_judge(NRF24_adapt_t * adapt)
+{
+	int sends = adapt->sends;
+	int failures = adapt->failures;
+	int retries = adapt->retries * 10 / sends;
+	adapt_resetWindow(adapt);
+
+	if (failures * 100 >= adapt->downPercent * sends || retries >= adapt->downRetries) {
+		adapt->cleanWindows = 0;
+		if (adapt->profile == 0) return;
+		ESP_LOGI(TAG, "step down from %d, %d of %d failed, retries %d.%d", adapt->profile, failures, sends, retries / 10, retries % 10);
+		adapt->upHold = (adapt->upHold * 2 > ADAPT_MAX_HOLD) ? ADAPT_MAX_HOLD : adapt->upHold * 2;
+		if (adapt_switch(adapt, adapt->profile - 1)) adapt->stepsDown++;
+		return;
+	}
+	if (failures != 0 || retries >= adapt->upRetries) {
+		adapt->cleanWindows = 0;
+		return;
+	}
+	if (++adapt->cleanWindows < adapt->upHold || adapt->profile + 1 >= adapt->count) return;
+	adapt->cleanWindows = 0;
+	ESP_LOGI(TAG, "step up from %d", adapt->profile);
+	if (adapt_switch(adapt, adapt->profile + 1)) {
+		adapt->stepsUp++;
+		adapt->upHold = (adapt->upHold / 2 < adapt->upWindows) ? adapt->upWindows : adapt->upHold / 2;
+	} else {
+		adapt->upHold = (adapt->upHold * 2 > ADAPT_MAX_HOLD) ? ADAPT_MAX_HOLD : adapt->upHold * 2;
+	}
+}
+
+// Sets up link adaptation over profiles (count of them, NULL for the default ladder
+// from 250Kbps to 2Mbps at low power). Both peers must use the same profiles, one of them as master.
+// Starts on profile 0. The tuning fields can be changed after this call.
+esp_err_t Nrf24_adaptInit(NRF24_adapt_t * adapt, NRF24_t * dev, const rf24_adapt_profile_t * profiles, size_t count, bool master)
+{
+	if (profiles == NULL) {
+		profiles = adapt_defaultProfiles;
+		count = sizeof(adapt_defaultProfiles) / sizeof(adapt_defaultProfiles[0]);
+	}
+	if (count == 0 || count > ADAPT_MAX_PROFILES) return ESP_ERR_INVALID_ARG;
+	if (!(dev->regs[DYNPD] & (1 << DPL_P0)) && dev->payload < ADAPT_CONTROL_LENGTH) return ESP_ERR_INVALID_SIZE;
+	memset(adapt, 0, sizeof(NRF24_adapt_t));
+	adapt->dev = dev;
+	adapt->master = master;
+	memcpy(adapt->profiles, profiles, count * sizeof(rf24_adapt_profile_t));
+	adapt->count = count;
+	adapt->window = 32;
+	adapt->downPercent = 10;
+	adapt->downRetries = 30;
+	adapt->upRetries = 5;
+	adapt->upWindows = 4;
+	adapt->upHold = adapt->upWindows;
+	adapt->fallbackFailures = 8;
+	adapt->silence = 1000;
+	adapt->lastRx = esp_timer_get_time();
+	adapt->lastTx = adapt->lastRx;
+	adapt_apply(adapt, 0);
+	return ESP_OK;
+}
+
+// Call it when the link may be idle.
+// The master sends a keepalive after silence / 2 ms without a send,
+// the slave returns to profile 0 after silence ms without a packet.
+void Nrf24_adaptUpdate(NRF24_adapt_t * adapt)
+{
+	int64_t now = esp_timer_get_time();
+	int64_t silence = (int64_t)adapt->silence * 1000;
+	if (adapt->master) {
+		if (now - adapt->lastTx < silence / 2) return;
+		adapt_control(adapt, ADAPT_PROBE, adapt->profile);
+		if (adapt->failuresInRow >= adapt->fallbackFailures && adapt->profile != 0) adapt_fallback(adapt);
+		return;
+	}
+	if (adapt->profile != 0 && now - adapt->lastRx > silence) adapt_fallback(adapt);
+}
+
+// Master: sends one packet with ACK and adapts the link to the outcome
+bool Nrf24_adaptSend(NRF24_adapt_t * adapt, uint8_t * value, uint8_t len)
+{
+	uint8_t retries;
+	bool acked = adapt_transmit(adapt, value, len, &retries);
+	if (adapt->failuresInRow >= adapt->fallbackFailures && adapt->profile != 0) {
+		adapt_fallback(adapt);
+		return acked;
+	}
+	adapt->sends++;
+	adapt->retries += retries;
+	if (!acked) adapt->failures++;
+	if (adapt->sends >= adapt->window) adapt_judge(adapt);
+	return acked;
+}
+
+// Waits up to timeout ms for a packet.
+// Control packets are handled here and never returned.
+bool Nrf24_adaptReceive(NRF24_adapt_t * adapt, rf24_packet_t * packet, int timeout)
+{
+	TickType_t startTick = xTaskGetTickCount();
+	while (1) {
+		Nrf24_adaptUpdate(adapt);
+		while (Nrf24_drainRx(adapt->dev, packet, 1)) {
+			adapt->lastRx = packet->timestamp;
+			if (packet->length < ADAPT_CONTROL_LENGTH || memcmp(packet->data, ADAPT_MAGIC, ADAPT_MAGIC_LENGTH) != 0) return true;
+			uint8_t profile = packet->data[ADAPT_MAGIC_LENGTH + 1];
+			if (!adapt->master && packet->data[ADAPT_MAGIC_LENGTH] == ADAPT_SET && profile < adapt->count) {
+				ESP_LOGI(TAG, "profile %d", profile);
+				adapt_apply(adapt, profile);
+			}
+		}
+		TickType_t diffTick = xTaskGetTickCount() - startTick;
+		if ( (diffTick * portTICK_PERIOD_MS) > timeout) return false;
+		vTaskDelay(1);
+	}
+}
@@ -0,0 +1,70 @@
+#ifndef MAIN_MIRF_ADAPT_H_
+#define MAIN_MIRF_ADAPT_H_
+
+#include "mirf.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * Link adaptation.
+ *
+ * Both peers share a ladder of profiles, from the most robust (0) to the fastest.
+ * The master watches ARC_CNT and MAX_RT over a window of sends and moves along the ladder.
+ * Control packet: ADAPT_MAGIC, ADAPT_SET or ADAPT_PROBE, profile.
+ * The slave switches when it reads ADAPT_SET, the master confirms with ADAPT_PROBE
+ * on the new profile and goes back when the probe is not acknowledged.
+ * A slave that heard nothing for silence ms and a master after fallbackFailures
+ * failed sends in a row both return to profile 0.
+ */
+#define ADAPT_MAGIC "ADP"
+#define ADAPT_MAGIC_LENGTH 3
+#define ADAPT_SET   0x01
+#define ADAPT_PROBE 0x02
+#define ADAPT_CONTROL_LENGTH (ADAPT_MAGIC_LENGTH + 2)
+#define ADAPT_MAX_PROFILES 8
+
+typedef struct {
+    rf24_datarate_e dataRate;
+    rf24_pa_dbm_e paLevel;
+    uint8_t retransmitDelay;// ARD, 0=250us ... 15=4000us
+} rf24_adapt_profile_t;
+
+typedef struct {
+    NRF24_t * dev;
+    bool master;
+    rf24_adapt_profile_t profiles[ADAPT_MAX_PROFILES];
+    uint8_t count;
+    uint8_t profile;// Current profile.
+    int window;// Sends judged together.
+    int downPercent;// MAX_RT rate that steps down.
+    int downRetries;// Average ARC_CNT, in tenths, that steps down.
+    int upRetries;// Average ARC_CNT, in tenths, below which a window is clean.
+    int upWindows;// Clean windows in a row before stepping up.
+    int fallbackFailures;// Master: failed sends in a row that return to profile 0.
+    int silence;// Slave: ms without a packet that return to profile 0. Master: idle ms before a keepalive.
+    // Window
+    int sends;
+    int failures;
+    int retries;
+    int cleanWindows;
+    int failuresInRow;
+    int upHold;// Current clean windows needed, doubles after a failed step.
+    int64_t lastRx;// esp_timer time of the last packet or ACK from the peer.
+    int64_t lastTx;// esp_timer time of the last send.
+    uint32_t stepsUp;
+    uint32_t stepsDown;
+    uint32_t fallbacks;
+} NRF24_adapt_t;
+
+esp_err_t Nrf24_adaptInit(NRF24_adapt_t * adapt, NRF24_t * dev, const rf24_adapt_profile_t * profiles, size_t count, bool master);
+void      Nrf24_adaptUpdate(NRF24_adapt_t * adapt);
+bool      Nrf24_adaptSend(NRF24_adapt_t * adapt, uint8_t * value, uint8_t len);
+bool      Nrf24_adaptReceive(NRF24_adapt_t * adapt, rf24_packet_t * packet, int timeout);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* MAIN_MIRF_ADAPT_H_ */
@@ -0,0 +1,228 @@
+#include <string.h>
+
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "esp_log.h"
+#include "esp_timer.h"
+#include "esp_random.h"
+
+#include "mirf_arq.h"
+
+#define TAG "NRF24_ARQ"
+
+// Seq distance from a to b, negative when b is behind a
+static int arq_distance(uint8_t a, uint8_t b)
+{
+	return (int8_t)(uint8_t)(b - a);
+}
+
+// Prepares ARQ over dev, which must be configured with the same fixed payload width on both sides.
+// window is the number of packets sent before waiting for an ACK (1 - 32).
+esp_err_t Nrf24_arqInit(NRF24_arq_t * arq, NRF24_t * dev, uint8_t window)
+{
+	memset(arq, 0, sizeof(NRF24_arq_t));
+	if (dev->payload <= ARQ_DATA_HEADER || dev->payload < ARQ_ACK_LENGTH) return ESP_ERR_INVALID_STATE;
+	if (window == 0 || window > ARQ_MAX_WINDOW) return ESP_ERR_INVALID_ARG;
+	arq->dev = dev;
+	arq->window = window;
+	arq->rto = 3000;
+	arq->ackWait = 2000;
+	arq->ackGap = 400;
+	arq->txSession = esp_random();
+	return ESP_OK;
+}
+
+// Marks the packets covered by an ACK. Packet i of the write has seq startSeq + i.
+static void arq_onAck(NRF24_arq_t * arq, const uint8_t * ack, uint8_t startSeq, size_t base, size_t count)
+{
+	uint8_t next = ack[2];
+	uint32_t bitmap = ack[3] | (ack[4] << 8) | (ack[5] << 16) | ((uint32_t)ack[6] << 24);
+	arq->txAcks++;
+	for (size_t i=base;i<count && i<base+arq->window;i++) {
+		uint8_t seq = startSeq + i;
+		int d = arq_distance(next, seq);
+		if (d < 0 || (d >= 1 && d <= 32 && (bitmap & (1UL << (d - 1))))) {
+			arq->txAcked[seq & (ARQ_MAX_WINDOW - 1)] = true;
+		}
+	}
+}
+
+// Sends len bytes reliably to the current TX address.
+// Up to window packets are streamed without hardware ACK, then the receiver's
+// ACK tells which arrived. Packets not acknowledged within rto are sent again.
+// Returns ESP_ERR_TIMEOUT when not everything was acknowledged within timeout ms.
+esp_err_t Nrf24_arqWrite(NRF24_arq_t * arq, const uint8_t * data, size_t len, int timeout)
+{
+	NRF24_t * dev = arq->dev;
+	size_t chunk = dev->payload - ARQ_DATA_HEADER;
+	size_t count = (len + chunk - 1) / chunk;
+	uint8_t startSeq = arq->txSeq;
+	size_t base = 0;
+	uint8_t packet[mirf_MAX_PAYLOAD];
+	int64_t deadline = esp_timer_get_time() + (int64_t)timeout * 1000;
+
+	memset(arq->txAcked, 0, sizeof(arq->txAcked));
+	memset(arq->txSentAt, 0, sizeof(arq->txSentAt));
+	while (base < count) {
+		int64_t now = esp_timer_get_time();
+		if (now > deadline) break;
+
+		// Burst: everything in the window that was not sent or timed out
+		int burst = 0;
+		for (size_t i=base;i<count && i<base+arq->window;i++) {
+			uint8_t seq = startSeq + i;
+			int slot = seq & (ARQ_MAX_WINDOW - 1);
+			if (arq->txAcked[slot]) continue;
+			if (arq->txSentAt[slot] && now - arq->txSentAt[slot] < arq->rto) continue;
+			size_t offset = i * chunk;
+			size_t size = (len - offset < chunk) ? len - offset : chunk;
+			memset(packet, 0, sizeof(packet));
+			packet[0] = ARQ_DATA;
+			packet[1] = arq->txSession;
+			packet[2] = seq;
+			packet[3] = startSeq + base;
+			packet[4] = size;
+			memcpy(&packet[ARQ_DATA_HEADER], &data[offset], size);
+			if (arq->txSentAt[slot]) arq->txRetransmits++;
+			Nrf24_writeFastNoAck(dev, packet);
+			arq->txSentAt[slot] = esp_timer_get_time();
+			arq->txPackets++;
+			burst++;
+		}
+		if (burst) Nrf24_txStandBy(dev, 100);
+
+		// Listen for the ACK of the burst
+		int64_t ackDeadline = esp_timer_get_time() + arq->ackWait;
+		while (esp_timer_get_time() < ackDeadline) {
+			rf24_packet_t rx;
+			if (Nrf24_drainRx(dev, &rx, 1) == 0) continue;
+			if (rx.data[0] != ARQ_ACK || rx.data[1] != arq->txSession) continue;
+			arq_onAck(arq, rx.data, startSeq, base, count);
+			break;
+		}
+
+		// Slide the window
+		while (base < count) {
+			int slot = (uint8_t)(startSeq + base) & (ARQ_MAX_WINDOW - 1);
+			if (!arq->txAcked[slot]) break;
+			arq->txAcked[slot] = false;
+			arq->txSentAt[slot] = 0;
+			base++;
+		}
+	}
+
+	// The next write starts after this one, the base in its packets lets the receiver skip what was lost
+	arq->txSeq = startSeq + count;
+	if (base < count) {
+		ESP_LOGW(TAG, "%zu of %zu packets not acknowledged", count - base, count);
+		return ESP_ERR_TIMEOUT;
+	}
+	return ESP_OK;
+}
+
+static void arq_onData(NRF24_arq_t * arq, const uint8_t * packet)
+{
+	uint8_t seq = packet[2];
+	uint8_t base = packet[3];
+	if (!arq->rxSynced || packet[1] != arq->rxSession) {
+		// New sender or restarted sender
+		arq->rxSynced = true;
+		arq->rxSession = packet[1];
+		arq->rxExpected = base;
+		memset(arq->rxSlots, 0, sizeof(arq->rxSlots));
+	}
+	arq->rxPackets++;
+	arq->rxAckPending = true;
+	arq->rxLast = esp_timer_get_time();
+
+	// The sender gave up on everything before base
+	while (arq_distance(arq->rxExpected, base) > 0 && !arq->rxSlots[arq->rxExpected & (ARQ_MAX_WINDOW - 1)].valid) {
+		arq->rxExpected++;
+	}
+
+	int d = arq_distance(arq->rxExpected, seq);
+	if (d < 0) {
+		arq->rxDuplicates++;
+		return;
+	}
+	if (d >= ARQ_MAX_WINDOW) {
+		// Reorder buffer full, the sender retransmits once the application has read
+		arq->rxOutOfWindow++;
+		return;
+	}
+	rf24_arq_slot_t * slot = &arq->rxSlots[seq & (ARQ_MAX_WINDOW - 1)];
+	if (slot->valid) {
+		arq->rxDuplicates++;
+		return;
+	}
+	uint8_t length = packet[4];
+	if (length > sizeof(slot->data)) length = sizeof(slot->data);
+	slot->valid = true;
+	slot->length = length;
+	memcpy(slot->data, &packet[ARQ_DATA_HEADER], length);
+}
+
+static void arq_buildAck(NRF24_arq_t * arq, uint8_t * packet)
+{
+	uint8_t next = arq->rxExpected;
+	while (arq_distance(arq->rxExpected, next) < ARQ_MAX_WINDOW && arq->rxSlots[next & (ARQ_MAX_WINDOW - 1)].valid) next++;
+	uint32_t bitmap = 0;
+	for (int k=0;k<32;k++) {
+		uint8_t seq = next + 1 + k;
+		if (arq_distance(arq->rxExpected, seq) >= ARQ_MAX_WINDOW) break;
+		if (arq->rxSlots[seq & (ARQ_MAX_WINDOW - 1)].valid) bitmap |= (1UL << k);
+	}
+	memset(packet, 0, mirf_MAX_PAYLOAD);
+	packet[0] = ARQ_ACK;
+	packet[1] = arq->rxSession;
+	packet[2] = next;
+	packet[3] = bitmap;
+	packet[4] = bitmap >> 8;
+	packet[5] = bitmap >> 16;
+	packet[6] = bitmap >> 24;
+}
+
+static void arq_sendAck(NRF24_arq_t * arq)
+{
+	NRF24_t * dev = arq->dev;
+	uint8_t packet[mirf_MAX_PAYLOAD];
+	arq_buildAck(arq, packet);
+	// Streamed so that the chip is back in RX as soon as the ACK is out
+	Nrf24_writeFastNoAck(dev, packet);
+	Nrf24_txStandBy(dev, 10);
+	arq->rxAckPending = false;
+	arq->rxAcks++;
+}
+
+// Waits up to timeout ms for the next packet in order and copies its data to data.
+// A burst is acknowledged once no packet arrived for ackGap us, so read until it
+// returns 0 to keep the sender going. Returns the data length, or 0 on timeout.
+int Nrf24_arqRead(NRF24_arq_t * arq, uint8_t * data, size_t size, int timeout)
+{
+	int64_t deadline = esp_timer_get_time() + (int64_t)timeout * 1000;
+	while (1) {
+		int64_t now = esp_timer_get_time();
+		if (arq->rxAckPending && now - arq->rxLast > arq->ackGap) arq_sendAck(arq);
+		if (!arq->rxAckPending) {
+			rf24_arq_slot_t * slot = &arq->rxSlots[arq->rxExpected & (ARQ_MAX_WINDOW - 1)];
+			if (slot->valid) {
+				size_t length = (slot->length < size) ? slot->length : size;
+				memcpy(data, slot->data, length);
+				slot->valid = false;
+				arq->rxExpected++;
+				return length;
+			}
+		}
+		if (now > deadline) return 0;
+
+		rf24_packet_t rx;
+		if (Nrf24_drainRx(arq->dev, &rx, 1)) {
+			if (rx.data[0] == ARQ_DATA) arq_onData(arq, rx.data);
+		} else if (now - arq->rxLast > 100000) {
+			// Idle link, no need to poll every microsecond
+			vTaskDelay(1);
+		} else {
+			taskYIELD();
+		}
+	}
+}
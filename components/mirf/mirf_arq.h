@@ -0,0 +1,67 @@
+#ifndef MAIN_MIRF_ARQ_H_
+#define MAIN_MIRF_ARQ_H_
+
+#include "mirf.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * Sliding window ARQ over packets sent without hardware ACK.
+ *
+ * Data packet: ARQ_DATA, session, seq, base, length, data.
+ * ACK packet:  ARQ_ACK, session, next missing seq, 32 bit bitmap of the seqs after it.
+ *
+ * Each side sends to the other with its TX address and receives on its RX address,
+ * so the ACKs come back on the reverse pipe.
+ */
+#define ARQ_DATA 0xA1
+#define ARQ_ACK  0xA2
+#define ARQ_DATA_HEADER 5
+#define ARQ_ACK_LENGTH 7
+#define ARQ_MAX_WINDOW 32
+
+typedef struct {
+    bool valid;
+    uint8_t length;
+    uint8_t data[mirf_MAX_PAYLOAD - ARQ_DATA_HEADER];
+} rf24_arq_slot_t;
+
+typedef struct {
+    NRF24_t * dev;
+    uint8_t window;// Packets in flight, 1 - 32.
+    int rto;// Retransmit timeout in us.
+    int ackWait;// us the sender listens for an ACK after a burst.
+    int ackGap;// Idle us after which the receiver sends its ACK.
+    // Sender
+    uint8_t txSession;// Random, tells the receiver to resynchronize.
+    uint8_t txSeq;// Seq of the next new packet.
+    bool txAcked[ARQ_MAX_WINDOW];
+    int64_t txSentAt[ARQ_MAX_WINDOW];// 0 = not sent yet.
+    // Receiver
+    bool rxSynced;
+    uint8_t rxSession;
+    uint8_t rxExpected;// Next seq to deliver.
+    bool rxAckPending;
+    int64_t rxLast;// esp_timer time of the last data packet.
+    rf24_arq_slot_t rxSlots[ARQ_MAX_WINDOW];// Reorder buffer indexed by seq.
+    // Counters
+    uint32_t txPackets;// Data packets sent, including retransmissions.
+    uint32_t txRetransmits;
+    uint32_t txAcks;// ACK packets received.
+    uint32_t rxPackets;// Data packets received.
+    uint32_t rxDuplicates;// Data packets received again.
+    uint32_t rxOutOfWindow;// Data packets too far ahead for the reorder buffer.
+    uint32_t rxAcks;// ACK packets sent.
+} NRF24_arq_t;
+
+esp_err_t Nrf24_arqInit(NRF24_arq_t * arq, NRF24_t * dev, uint8_t window);
+esp_err_t Nrf24_arqWrite(NRF24_arq_t * arq, const uint8_t * data, size_t len, int timeout);
+int       Nrf24_arqRead(NRF24_arq_t * arq, uint8_t * data, size_t size, int timeout);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* MAIN_MIRF_ARQ_H_ */
@@ -0,0 +1,104 @@
+#include <string.h>
+#include <stdlib.h>
+
+#include "esp_timer.h"
+
+#include "mirf_dedup.h"
+
+// Writes the source id and the next sequence number into the first two payload bytes.
+// Stamp a payload once and send the same bytes again when retrying it.
+void Nrf24_dedupStamp(NRF24_stamp_t * stamp, uint8_t * payload)
+{
+	payload[0] = stamp->source;
+	payload[1] = stamp->next++;
+}
+
+// Allocates a table for up to entries (pipe, source) pairs
+esp_err_t Nrf24_dedupInit(NRF24_dedup_t * dedup, size_t entries, int expiry)
+{
+	memset(dedup, 0, sizeof(NRF24_dedup_t));
+	if (entries == 0) return ESP_ERR_INVALID_ARG;
+	dedup->entries = calloc(entries, sizeof(rf24_dedup_entry_t));
+	if (dedup->entries == NULL) return ESP_ERR_NO_MEM;
+	dedup->count = entries;
+	dedup->expiry = expiry;
+	return ESP_OK;
+}
+
+void Nrf24_dedupDeinit(NRF24_dedup_t * dedup)
+{
+	free(dedup->entries);
+	memset(dedup, 0, sizeof(NRF24_dedup_t));
+}
+
+// Drops duplicates in the receive path of dev: Nrf24_dataReady()/Nrf24_getData(),
+// Nrf24_drainRx(), Nrf24_waitData() and the IRQ task. NULL turns it off.
+// pipes is a bit mask of the pipes whose payloads are all stamped, other pipes pass unfiltered.
+// Pipe 0 is reserved for auto-ack on PTX and receives the ACK payloads,
+// so asking for it (or for pipes above 5) returns ESP_ERR_INVALID_ARG.
+// Nrf24_receivePayload() bypasses the filter.
+esp_err_t Nrf24_setDedup(NRF24_t * dev, NRF24_dedup_t * dedup, uint8_t pipes)
+{
+	if (dedup) {
+		if (pipes & ~0x3E) return ESP_ERR_INVALID_ARG;
+		dedup->heldValid = false;
+		dedup->pipes = pipes;
+	}
+	dev->dedup = dedup;
+	return ESP_OK;
+}
+
+// Returns false when the stamped payload was already delivered.
+// Payloads too short to carry a stamp are always delivered.
+bool Nrf24_dedupCheck(NRF24_dedup_t * dedup, uint8_t pipe, const uint8_t * payload, uint8_t length)
+{
+	if (length < DEDUP_HEADER) return true;
+	uint8_t source = payload[0];
+	uint8_t seq = payload[1];
+	int64_t now = esp_timer_get_time();
+
+	// Find the source, or the least recently seen entry to reuse
+	rf24_dedup_entry_t * entry = NULL;
+	rf24_dedup_entry_t * oldest = &dedup->entries[0];
+	for (size_t i=0;i<dedup->count;i++) {
+		rf24_dedup_entry_t * e = &dedup->entries[i];
+		if (e->used && e->pipe == pipe && e->source == source) {
+			entry = e;
+			break;
+		}
+		if (!e->used || (oldest->used && e->lastSeen < oldest->lastSeen)) oldest = e;
+	}
+	if (entry && (now - entry->lastSeen) > (int64_t)dedup->expiry * 1000) entry->used = false;
+	if (entry == NULL || !entry->used) {
+		if (entry == NULL) {
+			entry = oldest;
+			if (entry->used) dedup->evictions++;
+		}
+		entry->used = true;
+		entry->pipe = pipe;
+		entry->source = source;
+		entry->last = seq;
+		entry->seen = 1;
+		entry->lastSeen = now;
+		dedup->passed++;
+		return true;
+	}
+
+	entry->lastSeen = now;
+	int d = (int8_t)(uint8_t)(seq - entry->last);
+	if (d > 0) {
+		entry->seen = (d < 32) ? (entry->seen << d) | 1 : 1;
+		entry->last = seq;
+	} else if (-d >= 32) {
+		// Far behind: the sender restarted its sequence
+		entry->seen = 1;
+		entry->last = seq;
+	} else if (entry->seen & (1UL << -d)) {
+		dedup->duplicates++;
+		return false;
+	} else {
+		entry->seen |= (1UL << -d);
+	}
+	dedup->passed++;
+	return true;
+}
@@ -0,0 +1,58 @@
+#ifndef MAIN_MIRF_DEDUP_H_
+#define MAIN_MIRF_DEDUP_H_
+
+#include "mirf.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * Duplicate suppression.
+ *
+ * The sender stamps the first two payload bytes with its source id and a
+ * sequence number, and sends the same stamped payload again when it retries.
+ * The receiver remembers the last 32 sequence numbers of each (pipe, source)
+ * and drops payloads it has already delivered.
+ * Only the pipes given to Nrf24_setDedup() are filtered, every payload on them must be stamped.
+ * Pipe 0 is reserved for auto-ack on PTX (ACK payloads arrive there) and cannot be filtered.
+ */
+#define DEDUP_HEADER 2
+
+typedef struct {
+    uint8_t source;
+    uint8_t next;// Sequence number of the next payload.
+} NRF24_stamp_t;
+
+typedef struct {
+    bool used;
+    uint8_t pipe;
+    uint8_t source;
+    uint8_t last;// Highest sequence number seen.
+    uint32_t seen;// Bit n: last - n was seen.
+    int64_t lastSeen;// esp_timer time.
+} rf24_dedup_entry_t;
+
+typedef struct NRF24_dedup_s {
+    rf24_dedup_entry_t * entries;
+    size_t count;
+    int expiry;// ms after which a silent source is forgotten, e.g. after a restart.
+    uint8_t pipes;// Bit n: pipe n carries stamped payloads, pipes 1 - 5.
+    rf24_packet_t held;// Polling mode: packet found by Nrf24_dataReady().
+    bool heldValid;
+    uint32_t passed;// Payloads delivered.
+    uint32_t duplicates;// Payloads dropped.
+    uint32_t evictions;// Sources forgotten because the table was full.
+} NRF24_dedup_t;
+
+void      Nrf24_dedupStamp(NRF24_stamp_t * stamp, uint8_t * payload);
+esp_err_t Nrf24_dedupInit(NRF24_dedup_t * dedup, size_t entries, int expiry);
+void      Nrf24_dedupDeinit(NRF24_dedup_t * dedup);
+esp_err_t Nrf24_setDedup(NRF24_t * dev, NRF24_dedup_t * dedup, uint8_t pipes);
+bool      Nrf24_dedupCheck(NRF24_dedup_t * dedup, uint8_t pipe, const uint8_t * payload, uint8_t length);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* MAIN_MIRF_DEDUP_H_ */
@@ -0,0 +1,208 @@
+#include <string.h>
+#include <stdlib.h>
+
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "esp_log.h"
+#include "esp_timer.h"
+#include "esp_rom_sys.h"
+
+#include "mirf_frag.h"
+
+#define TAG "NRF24_FRAG"
+
+// Polling receiver: gap after a fragment that still counts as streaming, and poll interval
+#define FRAG_SPIN_TIME 5000 // us
+#define FRAG_POLL_TIME 50 // us
+
+// Prepares fragmentation over dev, which must be configured with payloads larger than FRAG_HEADER.
+// Reassembly buffers of maxMessage bytes are allocated for the pipes set in the pipes bitmask,
+// so memory use is fixed up front. Partial messages are dropped after timeout ms.
+esp_err_t Nrf24_fragInit(NRF24_frag_t * frag, NRF24_t * dev, size_t maxMessage, uint8_t pipes, int timeout)
+{
+	memset(frag, 0, sizeof(NRF24_frag_t));
+	if (dev->payload <= FRAG_HEADER) return ESP_ERR_INVALID_STATE;
+	size_t chunk = dev->payload - FRAG_HEADER;
+	size_t count = (maxMessage + chunk - 1) / chunk;
+	if (maxMessage == 0 || count > FRAG_MAX_COUNT) return ESP_ERR_INVALID_SIZE;
+
+	frag->dev = dev;
+	frag->maxMessage = maxMessage;
+	frag->timeout = timeout;
+	frag->retries = 3;
+	frag->txBuffer = malloc(count * dev->payload);
+	frag->txResults = malloc(count * sizeof(rf24_tx_result_e));
+	if (frag->txBuffer == NULL || frag->txResults == NULL) {
+		Nrf24_fragDeinit(frag);
+		return ESP_ERR_NO_MEM;
+	}
+	for (int pipe=0;pipe<6;pipe++) {
+		if ((pipes & (1 << pipe)) == 0) continue;
+		frag->rx[pipe].data = malloc(maxMessage);
+		if (frag->rx[pipe].data == NULL) {
+			Nrf24_fragDeinit(frag);
+			return ESP_ERR_NO_MEM;
+		}
+	}
+	return ESP_OK;
+}
+
+void Nrf24_fragDeinit(NRF24_frag_t * frag)
+{
+	free(frag->txBuffer);
+	free(frag->txResults);
+	for (int pipe=0;pipe<6;pipe++) free(frag->rx[pipe].data);
+	memset(frag, 0, sizeof(NRF24_frag_t));
+}
+
+// Sends msg as numbered fragments to the current TX address.
+// All fragments are streamed back to back through the TX FIFO; fragments that
+// reached MAX_RT are streamed again, up to frag->retries more times.
+// timeout is in ms for each pass.
+esp_err_t Nrf24_fragSend(NRF24_frag_t * frag, const uint8_t * msg, size_t len, int timeout)
+{
+	NRF24_t * dev = frag->dev;
+	uint8_t payload = dev->payload;
+	size_t chunk = payload - FRAG_HEADER;
+	if (len == 0 || len > frag->maxMessage) return ESP_ERR_INVALID_SIZE;
+
+	size_t count = (len + chunk - 1) / chunk;
+	uint8_t msgId = frag->txId++;
+	for (size_t i=0;i<count;i++) {
+		uint8_t * fragment = &frag->txBuffer[i * payload];
+		size_t offset = i * chunk;
+		size_t size = (len - offset < chunk) ? len - offset : chunk;
+		fragment[0] = msgId;
+		fragment[1] = i;
+		fragment[2] = count;
+		fragment[3] = size;
+		memcpy(&fragment[FRAG_HEADER], &msg[offset], size);
+		memset(&fragment[FRAG_HEADER + size], 0, chunk - size);
+	}
+
+	size_t pending = count;
+	for (int pass=0;pass<=frag->retries;pass++) {
+		Nrf24_sendStream(dev, frag->txBuffer, pending, frag->txResults, timeout);
+		// Move the fragments that failed to the front for the next pass
+		size_t failed = 0;
+		for (size_t i=0;i<pending;i++) {
+			if (frag->txResults[i] == RF24_TX_ACKED) continue;
+			if (failed != i) memmove(&frag->txBuffer[failed * payload], &frag->txBuffer[i * payload], payload);
+			failed++;
+		}
+		pending = failed;
+		if (pending == 0) break;
+		ESP_LOGD(TAG, "Message %d: %zu fragments to resend", msgId, pending);
+	}
+
+	if (pending) {
+		frag->txFailed++;
+		return ESP_FAIL;
+	}
+	frag->txMessages++;
+	return ESP_OK;
+}
+
+static void frag_drop(NRF24_frag_t * frag, rf24_reassembly_t * rx)
+{
+	if (rx->active) frag->rxTimeouts++;
+	rx->active = false;
+}
+
+// Feeds one received packet into the reassembly of its pipe.
+// When it completes a message, the message is copied to msg and its length is returned.
+// Returns 0 while a message is incomplete and -1 when the packet was dropped.
+int Nrf24_fragInput(NRF24_frag_t * frag, const rf24_packet_t * packet, uint8_t * msg, size_t size)
+{
+	if (packet->pipe > 5 || frag->rx[packet->pipe].data == NULL) return -1;
+	rf24_reassembly_t * rx = &frag->rx[packet->pipe];
+	const uint8_t * fragment = packet->data;
+	uint8_t index = fragment[1];
+	uint8_t count = fragment[2];
+	uint8_t length = fragment[3];
+	size_t chunk = frag->dev->payload - FRAG_HEADER;
+	// Only the last fragment may carry less than a full chunk
+	if (packet->length <= FRAG_HEADER || count == 0 || index >= count || length > packet->length - FRAG_HEADER
+		|| (index < count - 1 && length != chunk) || index * chunk + length > frag->maxMessage) {
+		frag->rxErrors++;
+		return -1;
+	}
+
+	int64_t now = esp_timer_get_time();
+	// A fragment resent after its ACK was lost must not reopen a completed message
+	if (!rx->active && rx->done && rx->doneId == fragment[0]
+		&& (now - rx->doneAt) <= (int64_t)frag->timeout * 1000) return 0;
+	if (rx->active && (now - rx->start) > (int64_t)frag->timeout * 1000) frag_drop(frag, rx);
+	if (rx->active && (rx->msgId != fragment[0] || rx->count != count)) frag_drop(frag, rx);
+	if (!rx->active) {
+		rx->active = true;
+		rx->msgId = fragment[0];
+		rx->count = count;
+		rx->received = 0;
+		rx->length = 0;
+		rx->start = now;
+		memset(rx->bitmap, 0, sizeof(rx->bitmap));
+	}
+
+	// A retransmission whose ACK was lost arrives twice
+	if (rx->bitmap[index / 32] & (1UL << (index % 32))) return 0;
+	rx->bitmap[index / 32] |= (1UL << (index % 32));
+	rx->received++;
+	memcpy(&rx->data[index * chunk], &fragment[FRAG_HEADER], length);
+	if (index == count - 1) rx->length = index * chunk + length;
+	if (rx->received < count) return 0;
+
+	rx->active = false;
+	rx->done = true;
+	rx->doneId = rx->msgId;
+	rx->doneAt = now;
+	if (rx->length > size) {
+		frag->rxErrors++;
+		return -1;
+	}
+	memcpy(msg, rx->data, rx->length);
+	frag->rxMessages++;
+	return rx->length;
+}
+
+// Waits up to timeout ms for a complete message of at most size bytes.
+// In polling mode the 3-deep RX FIFO would overflow within a tick while fragments stream in,
+// so for FRAG_SPIN_TIME us after each fragment of an open message it is polled every
+// FRAG_POLL_TIME us. After that gap the sender has paused and the task sleeps a tick again.
+// Returns the message length, or 0 on timeout.
+int Nrf24_fragReceive(NRF24_frag_t * frag, uint8_t * msg, size_t size, uint8_t * pipe, int timeout)
+{
+	NRF24_t * dev = frag->dev;
+	rf24_packet_t packet;
+	int64_t lastFragment = 0;
+	TickType_t startTick = xTaskGetTickCount();
+	while (1) {
+		TickType_t diffTick = xTaskGetTickCount() - startTick;
+		int remaining = timeout - (int)(diffTick * portTICK_PERIOD_MS);
+		if (remaining < 0) return 0;
+
+		bool received;
+		if (dev->irqTask) {
+			received = Nrf24_waitData(dev, &packet, remaining);
+		} else {
+			received = Nrf24_drainRx(dev, &packet, 1) != 0;
+			if (!received) {
+				bool busy = false;
+				for (int i=0;i<6;i++) busy = busy || frag->rx[i].active;
+				if (busy && esp_timer_get_time() - lastFragment < FRAG_SPIN_TIME) {
+					esp_rom_delay_us(FRAG_POLL_TIME);
+				} else {
+					vTaskDelay(1);
+				}
+			}
+		}
+		if (!received) continue;
+		lastFragment = esp_timer_get_time();
+
+		int len = Nrf24_fragInput(frag, &packet, msg, size);
+		if (len > 0) {
+			if (pipe) *pipe = packet.pipe;
+			return len;
+		}
+	}
+}
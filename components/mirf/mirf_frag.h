@@ -0,0 +1,61 @@
+#ifndef MAIN_MIRF_FRAG_H_
+#define MAIN_MIRF_FRAG_H_
+
+#include "mirf.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * Fragment header: message id, fragment index, fragment count, data length.
+ *
+ * Each fragment is one fixed size payload of dev->payload bytes.
+ */
+#define FRAG_HEADER 4
+#define FRAG_MAX_COUNT 255
+
+/**
+ * Message being reassembled on one pipe.
+ */
+typedef struct {
+    uint8_t * data;// maxMessage bytes, NULL when the pipe is not used.
+    bool active;
+    uint8_t msgId;
+    uint8_t count;// Fragments in the message.
+    uint8_t received;// Fragments received so far.
+    uint32_t bitmap[(FRAG_MAX_COUNT + 31) / 32];// Fragments received so far.
+    size_t length;
+    int64_t start;// esp_timer time of the first fragment.
+    bool done;// A message with doneId was completed at doneAt.
+    uint8_t doneId;
+    int64_t doneAt;// esp_timer time.
+} rf24_reassembly_t;
+
+typedef struct {
+    NRF24_t * dev;
+    size_t maxMessage;// Largest message in bytes.
+    int timeout;// Milliseconds a partial message is kept.
+    int retries;// Passes over fragments that reached MAX_RT.
+    uint8_t txId;
+    uint8_t * txBuffer;// Fragments of the message being sent.
+    rf24_tx_result_e * txResults;
+    rf24_reassembly_t rx[6];
+    uint32_t txMessages;// Messages sent completely.
+    uint32_t txFailed;// Messages with fragments that were never acknowledged.
+    uint32_t rxMessages;// Messages reassembled.
+    uint32_t rxTimeouts;// Partial messages dropped after timeout or replaced by a newer one.
+    uint32_t rxErrors;// Malformed fragments and messages too large for the caller.
+} NRF24_frag_t;
+
+esp_err_t Nrf24_fragInit(NRF24_frag_t * frag, NRF24_t * dev, size_t maxMessage, uint8_t pipes, int timeout);
+void      Nrf24_fragDeinit(NRF24_frag_t * frag);
+esp_err_t Nrf24_fragSend(NRF24_frag_t * frag, const uint8_t * msg, size_t len, int timeout);
+int       Nrf24_fragInput(NRF24_frag_t * frag, const rf24_packet_t * packet, uint8_t * msg, size_t size);
+int       Nrf24_fragReceive(NRF24_frag_t * frag, uint8_t * msg, size_t size, uint8_t * pipe, int timeout);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* MAIN_MIRF_FRAG_H_ */
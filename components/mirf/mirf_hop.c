@@ -0,0 +1,249 @@
+#include <string.h>
+
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "esp_log.h"
+#include "esp_timer.h"
+
+#include "mirf_hop.h"
+
+#define TAG "HOP"
+
+#define HOP_SEND_TIMEOUT 100 // ms
+
+static bool hop_isBlacklisted(NRF24_hop_t * hop, uint8_t ch)
+{
+	return hop->blacklist[ch / 8] & (1 << (ch % 8));
+}
+
+static uint32_t hop_random(uint32_t * state)
+{
+	// xorshift32, the same on both peers
+	uint32_t x = *state;
+	x ^= x << 13;
+	x ^= x >> 17;
+	x ^= x << 5;
+	*state = x;
+	return x;
+}
+
+// Channel of a slot: its entry in the sequence, or the next one that is not blacklisted.
+// Both peers share the blacklist through the beacons, so they agree on the result.
+static uint8_t hop_channel(NRF24_hop_t * hop, uint16_t slot)
+{
+	uint8_t index = slot % hop->length;
+	for (int i=0;i<hop->length;i++) {
+		uint8_t ch = hop->sequence[(index + i) % hop->length];
+		if (!hop_isBlacklisted(hop, ch)) return ch;
+	}
+	return hop->sequence[index];
+}
+
+// Retunes through RF_CH alone, the rest of the configuration stays as it is
+static void hop_tune(NRF24_hop_t * hop, uint8_t ch)
+{
+	NRF24_t * dev = hop->dev;
+	if (dev->regs[RF_CH] == ch) return;
+	Nrf24_ceLow(dev);
+	Nrf24_configRegister(dev, RF_CH, ch);
+	dev->channel = ch;
+	// The PLL settles within 130us of CE going high again
+	if (!dev->PTX) Nrf24_ceHi(dev);
+	hop->hops++;
+}
+
+static int hop_activeChannels(NRF24_hop_t * hop)
+{
+	int active = 0;
+	for (int i=0;i<hop->length;i++) {
+		if (!hop_isBlacklisted(hop, hop->sequence[i])) active++;
+	}
+	return active;
+}
+
+// Master: counts a send on ch and blacklists the channel when too many ended in MAX_RT
+static void hop_record(NRF24_hop_t * hop, uint8_t ch, bool acked, int64_t now)
+{
+	// While the slave is searching every send fails, which says nothing about the channel
+	if (!acked && now - hop->lastRx > (int64_t)hop->lostSlots * hop->dwell * 1000) return;
+	if (acked) hop->lastRx = now;
+	hop->attempts[ch]++;
+	if (!acked) hop->failures[ch]++;
+	if (hop->attempts[ch] < hop->minAttempts) return;
+	if (hop->failures[ch] * 100 >= hop->maxRtPercent * hop->attempts[ch]
+		&& hop_activeChannels(hop) > hop->minChannels) {
+		ESP_LOGI(TAG, "channel %d blacklisted, %d of %d sends failed", ch, hop->failures[ch], hop->attempts[ch]);
+		hop->blacklist[ch / 8] |= (1 << (ch % 8));
+		hop->blacklistedAt[ch] = now / 1000;
+		hop->blacklistings++;
+	}
+	hop->attempts[ch] = 0;
+	hop->failures[ch] = 0;
+}
+
+// Master: gives blacklisted channels another chance after probation ms
+static void hop_probation(NRF24_hop_t * hop, int64_t now)
+{
+	uint32_t ms = now / 1000;
+	for (int i=0;i<hop->length;i++) {
+		uint8_t ch = hop->sequence[i];
+		if (!hop_isBlacklisted(hop, ch)) continue;
+		if (ms - hop->blacklistedAt[ch] < (uint32_t)hop->probation) continue;
+		hop->blacklist[ch / 8] &= ~(1 << (ch % 8));
+	}
+}
+
+static bool hop_transmit(NRF24_hop_t * hop, uint8_t * value, uint8_t len)
+{
+	uint8_t ch = hop->dev->regs[RF_CH];
+	Nrf24_sendPacket(hop->dev, value, len, true);
+	bool acked = Nrf24_isSend(hop->dev, HOP_SEND_TIMEOUT);
+	if (hop->master) hop_record(hop, ch, acked, esp_timer_get_time());
+	return acked;
+}
+
+static void hop_sendBeacon(NRF24_hop_t * hop)
+{
+	uint8_t beacon[mirf_MAX_PAYLOAD];
+	memset(beacon, 0, sizeof(beacon));
+	memcpy(beacon, HOP_MAGIC, HOP_MAGIC_LENGTH);
+	beacon[HOP_MAGIC_LENGTH] = hop->slot & 0xFF;
+	beacon[HOP_MAGIC_LENGTH + 1] = hop->slot >> 8;
+	memcpy(&beacon[HOP_MAGIC_LENGTH + 2], hop->blacklist, sizeof(hop->blacklist));
+	hop_transmit(hop, beacon, HOP_BEACON_LENGTH);
+}
+
+static bool hop_isBeacon(const rf24_packet_t * packet)
+{
+	return packet->length >= HOP_BEACON_LENGTH && memcmp(packet->data, HOP_MAGIC, HOP_MAGIC_LENGTH) == 0;
+}
+
+// Slave: takes slot, slot phase and blacklist from the master
+static void hop_onBeacon(NRF24_hop_t * hop, const rf24_packet_t * packet)
+{
+	hop->slot = packet->data[HOP_MAGIC_LENGTH] | (packet->data[HOP_MAGIC_LENGTH + 1] << 8);
+	// The beacon leaves at the start of the slot. The timestamp is the IRQ edge with the IRQ task,
+	// otherwise the time of the poll, up to a tick late; dwell is long against both.
+	hop->slotStart = packet->timestamp;
+	memcpy(hop->blacklist, &packet->data[HOP_MAGIC_LENGTH + 2], sizeof(hop->blacklist));
+	if (!hop->synced) {
+		ESP_LOGI(TAG, "synced at slot %d", hop->slot);
+		hop->synced = true;
+		hop->resyncs++;
+	}
+	hop_tune(hop, hop_channel(hop, hop->slot));
+}
+
+// Sets up hopping over channels (count of them, NULL for 0 - 125) in an order derived from seed.
+// Both peers must use the same seed, channels and dwell, one of them as master.
+// dwell is at least HOP_MIN_DWELL_TICKS ticks.
+// The payload width (or dynamic payloads on pipe 0) must fit HOP_BEACON_LENGTH.
+// The tuning fields can be changed after this call.
+esp_err_t Nrf24_hopInit(NRF24_hop_t * hop, NRF24_t * dev, uint32_t seed, const uint8_t * channels, size_t count, int dwell, bool master)
+{
+	if (channels == NULL) count = HOP_CHANNELS;
+	if (count == 0 || count > HOP_CHANNELS) return ESP_ERR_INVALID_ARG;
+	if (dwell < HOP_MIN_DWELL_TICKS * portTICK_PERIOD_MS) return ESP_ERR_INVALID_ARG;
+	if (!(dev->regs[DYNPD] & (1 << DPL_P0)) && dev->payload < HOP_BEACON_LENGTH) return ESP_ERR_INVALID_SIZE;
+	memset(hop, 0, sizeof(NRF24_hop_t));
+	hop->dev = dev;
+	hop->master = master;
+	hop->dwell = dwell;
+	hop->lostSlots = 3;
+	hop->minChannels = (count < 8) ? count : 8;
+	hop->maxRtPercent = 50;
+	hop->minAttempts = 16;
+	hop->probation = 10000;
+
+	for (size_t i=0;i<count;i++) {
+		uint8_t ch = channels ? channels[i] : i;
+		if (ch >= HOP_CHANNELS) return ESP_ERR_INVALID_ARG;
+		hop->sequence[i] = ch;
+	}
+	hop->length = count;
+	// Fisher-Yates shuffle, xorshift must not start from 0
+	uint32_t state = seed ? seed : 1;
+	for (int i=count-1;i>0;i--) {
+		int j = hop_random(&state) % (i + 1);
+		uint8_t ch = hop->sequence[i];
+		hop->sequence[i] = hop->sequence[j];
+		hop->sequence[j] = ch;
+	}
+
+	int64_t now = esp_timer_get_time();
+	hop->slotStart = now;
+	hop->parkStart = now;
+	hop->synced = master;
+	hop_tune(hop, hop->sequence[0]);
+	if (master) hop_sendBeacon(hop);
+	return ESP_OK;
+}
+
+// Follows the hop sequence, call it at least a few times per dwell.
+// The master retunes and sends a beacon at the start of each slot.
+// A slave that heard nothing for lostSlots slots waits on one channel
+// for a whole cycle of the master, then tries the next one.
+// Returns the current channel.
+uint8_t Nrf24_hopUpdate(NRF24_hop_t * hop)
+{
+	int64_t now = esp_timer_get_time();
+	int64_t dwell = (int64_t)hop->dwell * 1000;
+
+	if (!hop->master && hop->synced && now - hop->lastRx > hop->lostSlots * dwell) {
+		ESP_LOGW(TAG, "lost sync at slot %d", hop->slot);
+		hop->synced = false;
+		hop->parkIndex = hop->slot % hop->length;
+		hop->parkStart = now;
+	}
+
+	if (!hop->synced) {
+		if (now - hop->parkStart > (hop->length + 1) * dwell) {
+			hop->parkIndex = (hop->parkIndex + 1) % hop->length;
+			hop->parkStart = now;
+		}
+		hop_tune(hop, hop->sequence[hop->parkIndex]);
+		return hop->dev->regs[RF_CH];
+	}
+
+	if (now - hop->slotStart >= dwell) {
+		int64_t slots = (now - hop->slotStart) / dwell;
+		hop->slot += slots;
+		hop->slotStart += slots * dwell;
+		if (hop->master) hop_probation(hop, now);
+		hop_tune(hop, hop_channel(hop, hop->slot));
+		if (hop->master) hop_sendBeacon(hop);
+	}
+	return hop->dev->regs[RF_CH];
+}
+
+// Sends one packet with ACK on the current channel.
+// The master counts the outcome against the channel.
+bool Nrf24_hopSend(NRF24_hop_t * hop, uint8_t * value, uint8_t len)
+{
+	Nrf24_hopUpdate(hop);
+	return hop_transmit(hop, value, len);
+}
+
+// Waits up to timeout ms for a packet while following the hop sequence.
+// Beacons are consumed here and never returned.
+bool Nrf24_hopReceive(NRF24_hop_t * hop, rf24_packet_t * packet, int timeout)
+{
+	TickType_t startTick = xTaskGetTickCount();
+	while (1) {
+		Nrf24_hopUpdate(hop);
+		while (Nrf24_drainRx(hop->dev, packet, 1)) {
+			if (hop_isBeacon(packet)) {
+				if (!hop->master) {
+					hop->lastRx = packet->timestamp;
+					hop_onBeacon(hop, packet);
+				}
+				continue;
+			}
+			hop->lastRx = packet->timestamp;
+			return true;
+		}
+		TickType_t diffTick = xTaskGetTickCount() - startTick;
+		if ( (diffTick * portTICK_PERIOD_MS) > timeout) return false;
+		vTaskDelay(1);
+	}
+}
@@ -0,0 +1,62 @@
+#ifndef MAIN_MIRF_HOP_H_
+#define MAIN_MIRF_HOP_H_
+
+#include "mirf.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * Frequency hopping.
+ *
+ * Both peers derive the same hop sequence from a shared seed. The master
+ * changes channel every dwell ms and sends a sync beacon at the start of
+ * each slot: HOP_MAGIC, slot number, blacklist bitmap. The slave follows
+ * on its own timer and corrects slot and phase from each beacon.
+ * A slave that lost the master waits on one channel until the master comes by.
+ */
+#define HOP_CHANNELS 126
+#define HOP_MAGIC "HOP"
+#define HOP_MAGIC_LENGTH 3
+#define HOP_BEACON_LENGTH (HOP_MAGIC_LENGTH + 2 + HOP_CHANNELS / 8 + 1)
+// Polling reads a beacon up to a tick late and sending one costs a tick,
+// so a slot must be several ticks long
+#define HOP_MIN_DWELL_TICKS 5
+
+typedef struct {
+    NRF24_t * dev;
+    bool master;
+    uint8_t sequence[HOP_CHANNELS];// Channels in hop order.
+    uint8_t length;
+    int dwell;// ms on each channel.
+    int lostSlots;// Slots without a packet before the slave searches again.
+    int minChannels;// Channels that are never blacklisted.
+    int maxRtPercent;// MAX_RT rate that blacklists a channel.
+    int minAttempts;// Packets on a channel before it is judged.
+    int probation;// ms a channel stays blacklisted.
+    uint16_t slot;
+    int64_t slotStart;// esp_timer time.
+    bool synced;
+    int64_t lastRx;// esp_timer time of the last packet from the peer.
+    uint8_t parkIndex;// Slave: sequence index waited on while searching.
+    int64_t parkStart;
+    uint8_t blacklist[(HOP_CHANNELS + 7) / 8];
+    uint32_t blacklistedAt[HOP_CHANNELS];// ms
+    uint16_t attempts[HOP_CHANNELS];
+    uint16_t failures[HOP_CHANNELS];
+    uint32_t hops;
+    uint32_t resyncs;// Slave: times sync was (re)gained.
+    uint32_t blacklistings;
+} NRF24_hop_t;
+
+esp_err_t Nrf24_hopInit(NRF24_hop_t * hop, NRF24_t * dev, uint32_t seed, const uint8_t * channels, size_t count, int dwell, bool master);
+uint8_t   Nrf24_hopUpdate(NRF24_hop_t * hop);
+bool      Nrf24_hopSend(NRF24_hop_t * hop, uint8_t * value, uint8_t len);
+bool      Nrf24_hopReceive(NRF24_hop_t * hop, rf24_packet_t * packet, int timeout);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* MAIN_MIRF_HOP_H_ */
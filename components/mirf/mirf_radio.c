@@ -0,0 +1,185 @@
+#include <string.h>
+
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "esp_log.h"
+#include "esp_timer.h"
+
+#include "mirf_radio.h"
+
+#define TAG "NRF24_RADIO"
+
+// Packet queued by Nrf24_radioSend
+typedef struct {
+	uint8_t len;
+	bool ack;
+	bool useAddr;
+	uint8_t addr[mirf_ADDR_LEN];
+	uint8_t data[mirf_MAX_PAYLOAD];
+} radio_packet_t;
+
+// Points TX_ADDR and RX_ADDR_P0 (for the ACK) at addr, unless they already are
+static void radio_setTxAddr(NRF24_t * dev, uint8_t * addr)
+{
+	uint8_t width = Nrf24_getAddressWidth(dev);
+	if (memcmp(dev->addr[2], addr, width) == 0) return;
+	Nrf24_acquireBus(dev);
+	Nrf24_writeRegister(dev, RX_ADDR_P0, addr, width);
+	Nrf24_writeRegister(dev, TX_ADDR, addr, width);
+	Nrf24_releaseBus(dev);
+}
+
+// Longest a send can take with the retransmit settings in the shadow registers:
+// every try is one packet with its ACK plus ARD
+static int64_t radio_airtime(NRF24_t * dev)
+{
+	uint8_t retr = dev->regs[SETUP_RETR];
+	int count = (retr >> ARC) & 0x0F;
+	int delay = (((retr >> ARD) & 0x0F) + 1) * 250;
+	// 32 byte packet and ACK with preamble, address and CRC
+	int packet = 250;
+	if (dev->regs[RF_SETUP] & (1 << RF_DR_LOW)) {
+		packet = 1800;
+	} else if (!(dev->regs[RF_SETUP] & (1 << RF_DR_HIGH))) {
+		packet = 450;
+	}
+	// 130us PLL settling before the first try
+	return 130 + (int64_t)(count + 1) * (delay + packet);
+}
+
+static void radio_send(NRF24_radio_t * radio, radio_packet_t * packet)
+{
+	NRF24_t * dev = radio->dev;
+	if (packet->useAddr) radio_setTxAddr(dev, packet->addr);
+	Nrf24_sendPacket(dev, packet->data, packet->len, packet->ack);
+	if (dev->irqTask == NULL) {
+		// A packet takes well under a tick, so spin on STATUS for the expected airtime
+		// rather than let Nrf24_isSend sleep a tick for each packet.
+		// A chip that does not answer in time is left to the sleeping Nrf24_isSend.
+		int64_t deadline = esp_timer_get_time() + radio_airtime(dev);
+		while (!(Nrf24_pollStatus(dev, (1 << TX_DS) | (1 << MAX_RT)) & ((1 << TX_DS) | (1 << MAX_RT)))) {
+			if (esp_timer_get_time() > deadline) break;
+		}
+	}
+	// Nrf24_isSend normally finds the flags at once and returns the chip to listening
+	if (Nrf24_isSend(dev, radio->txTimeout)) {
+		radio->txCount++;
+	} else {
+		radio->txFailed++;
+	}
+}
+
+// Polling mode only: move what the chip has received to rxQueue
+static void radio_drain(NRF24_radio_t * radio)
+{
+	rf24_packet_t packets[3];
+	uint8_t count = Nrf24_drainRx(radio->dev, packets, 3);
+	for (int i=0;i<count;i++) {
+		radio->rxCount++;
+		if (xQueueSend(radio->rxQueue, &packets[i], 0) != pdTRUE) radio->rxDropped++;
+	}
+}
+
+// Listens between TX bursts. In polling mode the RX FIFO is drained once per tick.
+// With the IRQ task, received packets bypass this task and the owner sleeps until there is something to send.
+static void radio_task(void * arg)
+{
+	NRF24_radio_t * radio = (NRF24_radio_t *)arg;
+	NRF24_t * dev = radio->dev;
+	radio_packet_t packet;
+	TickType_t window = dev->irqTask ? portMAX_DELAY : 1;
+
+	while (radio->running) {
+		if (dev->irqTask == NULL) radio_drain(radio);
+		// RX window: wait for something to send
+		if (xQueuePeek(radio->txQueue, &packet, window) != pdTRUE) continue;
+		// TX burst, bounded so that receiving is not starved
+		for (int i=0;i<radio->txBurst;i++) {
+			if (xQueueReceive(radio->txQueue, &packet, 0) != pdTRUE) break;
+			if (packet.len == 0) break; // Wake-up from Nrf24_radioStop
+			radio_send(radio, &packet);
+			if (dev->irqTask == NULL) radio_drain(radio);
+		}
+	}
+	xSemaphoreGive(radio->stopped);
+	vTaskDelete(NULL);
+}
+
+// Starts the owner task of dev. dev must be initialized and configured, and
+// must not be used directly afterwards. Up to txBurst packets are sent in a row
+// before the radio listens again.
+esp_err_t Nrf24_radioStart(NRF24_radio_t * radio, NRF24_t * dev, UBaseType_t txDepth, UBaseType_t rxDepth, int txBurst)
+{
+	memset(radio, 0, sizeof(NRF24_radio_t));
+	radio->dev = dev;
+	radio->txBurst = (txBurst > 0) ? txBurst : 1;
+	radio->txTimeout = 1000;
+	radio->txQueue = xQueueCreate(txDepth, sizeof(radio_packet_t));
+	// With the IRQ task, its queue already delivers received packets
+	radio->rxQueue = dev->irqTask ? dev->rxQueue : xQueueCreate(rxDepth, sizeof(rf24_packet_t));
+	radio->stopped = xSemaphoreCreateBinary();
+	if (radio->txQueue == NULL || radio->rxQueue == NULL || radio->stopped == NULL) {
+		Nrf24_radioStop(radio);
+		return ESP_ERR_NO_MEM;
+	}
+
+	radio->running = true;
+	if (xTaskCreate(radio_task, "NRF24_RADIO", 1024*3, radio, CONFIG_IRQ_TASK_PRIORITY - 1, &radio->task) != pdPASS) {
+		radio->running = false;
+		radio->task = NULL;
+		Nrf24_radioStop(radio);
+		return ESP_ERR_NO_MEM;
+	}
+	return ESP_OK;
+}
+
+// Stops the owner task. Packets still queued are discarded.
+void Nrf24_radioStop(NRF24_radio_t * radio)
+{
+	if (radio->task) {
+		radio_packet_t wakeup = { .len = 0 };
+		radio->running = false;
+		xQueueSendToFront(radio->txQueue, &wakeup, portMAX_DELAY);
+		xSemaphoreTake(radio->stopped, portMAX_DELAY);
+		radio->task = NULL;
+	}
+	if (radio->txQueue) vQueueDelete(radio->txQueue);
+	if (radio->rxQueue && radio->rxQueue != radio->dev->rxQueue) vQueueDelete(radio->rxQueue);
+	if (radio->stopped) vSemaphoreDelete(radio->stopped);
+	radio->txQueue = NULL;
+	radio->rxQueue = NULL;
+	radio->stopped = NULL;
+}
+
+static esp_err_t radio_queue(NRF24_radio_t * radio, const uint8_t * addr, const uint8_t * value, uint8_t len, bool ack, int timeout)
+{
+	radio_packet_t packet;
+	if (len == 0 || len > mirf_MAX_PAYLOAD) return ESP_ERR_INVALID_SIZE;
+	memset(&packet, 0, sizeof(packet));
+	packet.len = len;
+	packet.ack = ack;
+	packet.useAddr = (addr != NULL);
+	if (addr) memcpy(packet.addr, addr, Nrf24_getAddressWidth(radio->dev));
+	memcpy(packet.data, value, len);
+	if (xQueueSend(radio->txQueue, &packet, pdMS_TO_TICKS(timeout)) != pdTRUE) return ESP_ERR_TIMEOUT;
+	return ESP_OK;
+}
+
+// Queues len bytes for transmission to addr (address width bytes, NULL keeps the current TX_ADDR).
+// Can be called from any task. Waits up to timeout ms for room in the queue.
+esp_err_t Nrf24_radioSend(NRF24_radio_t * radio, const uint8_t * addr, const uint8_t * value, uint8_t len, int timeout)
+{
+	return radio_queue(radio, addr, value, len, true, timeout);
+}
+
+// Same as Nrf24_radioSend, but the packet is sent once without requesting an ACK
+esp_err_t Nrf24_radioSendNoAck(NRF24_radio_t * radio, const uint8_t * addr, const uint8_t * value, uint8_t len, int timeout)
+{
+	return radio_queue(radio, addr, value, len, false, timeout);
+}
+
+// Waits up to timeout ms for a received packet. Can be called from any task.
+bool Nrf24_radioReceive(NRF24_radio_t * radio, rf24_packet_t * packet, int timeout)
+{
+	return xQueueReceive(radio->rxQueue, packet, pdMS_TO_TICKS(timeout)) == pdTRUE;
+}
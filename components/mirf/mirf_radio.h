@@ -0,0 +1,41 @@
+#ifndef MAIN_MIRF_RADIO_H_
+#define MAIN_MIRF_RADIO_H_
+
+#include "mirf.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * Radio owner service.
+ *
+ * One task owns the NRF24_t and is the only one touching the chip.
+ * Any number of tasks send and receive through its queues.
+ */
+typedef struct {
+    NRF24_t * dev;
+    QueueHandle_t txQueue;// Packets waiting for transmission.
+    QueueHandle_t rxQueue;// rf24_packet_t waiting for a reader.
+    TaskHandle_t task;// Owner task.
+    SemaphoreHandle_t stopped;// Given by the owner task when it exits.
+    volatile bool running;
+    int txBurst;// Packets sent per TX burst before listening again.
+    int txTimeout;// Milliseconds to wait for TX_DS or MAX_RT.
+    uint32_t txCount;// Packets sent, and acknowledged when an ACK was requested.
+    uint32_t txFailed;// Packets that reached MAX_RT or timed out.
+    uint32_t rxCount;// Packets received.
+    uint32_t rxDropped;// Packets dropped because rxQueue was full.
+} NRF24_radio_t;
+
+esp_err_t Nrf24_radioStart(NRF24_radio_t * radio, NRF24_t * dev, UBaseType_t txDepth, UBaseType_t rxDepth, int txBurst);
+void      Nrf24_radioStop(NRF24_radio_t * radio);
+esp_err_t Nrf24_radioSend(NRF24_radio_t * radio, const uint8_t * addr, const uint8_t * value, uint8_t len, int timeout);
+esp_err_t Nrf24_radioSendNoAck(NRF24_radio_t * radio, const uint8_t * addr, const uint8_t * value, uint8_t len, int timeout);
+bool      Nrf24_radioReceive(NRF24_radio_t * radio, rf24_packet_t * packet, int timeout);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* MAIN_MIRF_RADIO_H_ */
@@ -0,0 +1,74 @@
+#include <stdio.h>
+#include <string.h>
+
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "esp_rom_sys.h"
+
+#include "mirf_scan.h"
+
+// Counts how often each channel carries a signal above -64dBm (RPD, nRF24L01+ only).
+// channels lists the channels to sweep (count of them), NULL sweeps 0 - 125.
+// Each sweep costs per channel one RF_CH write, a CE pulse of dwell us and one RPD read,
+// so a full sweep at the minimum dwell takes about 25ms. The SPI bus is only held for
+// the commands, and the task sleeps a tick between sweeps.
+// histogram has SCAN_CHANNELS entries indexed by channel and is cleared first;
+// each channel is sampled once per repeat.
+// The previous channel and RX mode are restored afterwards.
+esp_err_t Nrf24_scan(NRF24_t * dev, const uint8_t * channels, size_t count, int dwell, int repeats, uint16_t * histogram)
+{
+	if (channels == NULL) count = SCAN_CHANNELS;
+	if (count == 0 || repeats <= 0) return ESP_ERR_INVALID_ARG;
+	if (dwell < SCAN_MIN_DWELL) dwell = SCAN_MIN_DWELL;
+	memset(histogram, 0, SCAN_CHANNELS * sizeof(uint16_t));
+
+	uint8_t channel = dev->regs[RF_CH];
+	Nrf24_acquireBus(dev);
+	Nrf24_ceLow(dev);
+	Nrf24_powerUpRx(dev);
+	Nrf24_ceLow(dev);
+	Nrf24_releaseBus(dev);
+	for (int r=0;r<repeats;r++) {
+		// Give lower priority tasks a tick between sweeps
+		if (r > 0) vTaskDelay(1);
+		for (size_t i=0;i<count;i++) {
+			uint8_t ch = channels ? channels[i] : i;
+			if (ch >= SCAN_CHANNELS) continue;
+			// The bus is free while the receiver listens
+			Nrf24_configRegister(dev, RF_CH, ch);
+			Nrf24_ceHi(dev);
+			esp_rom_delay_us(dwell);
+			Nrf24_ceLow(dev);
+			// RPD is latched when CE goes low
+			uint8_t rpd;
+			Nrf24_command(dev, R_REGISTER | RPD, NULL, &rpd, 1);
+			if (rpd & 1) histogram[ch]++;
+		}
+	}
+	Nrf24_acquireBus(dev);
+	Nrf24_configRegister(dev, RF_CH, channel);
+	Nrf24_powerUpRx(dev);
+	Nrf24_releaseBus(dev);
+	return ESP_OK;
+}
+
+// Prints one character per channel: '-' for quiet, '1' - '9' for the share of busy samples
+void Nrf24_printScan(const uint16_t * histogram, int repeats)
+{
+	char line[SCAN_CHANNELS + 1];
+	for (int ch=0;ch<SCAN_CHANNELS;ch++) {
+		if (histogram[ch] == 0 || repeats <= 0) {
+			line[ch] = '-';
+		} else {
+			int level = (histogram[ch] * 9 + repeats - 1) / repeats;
+			line[ch] = '0' + ((level > 9) ? 9 : level);
+		}
+	}
+	line[SCAN_CHANNELS] = 0;
+	// Tens digit every ten channels, then the units digit of each channel
+	for (int ch=0;ch<SCAN_CHANNELS;ch++) printf("%c", (ch % 10) ? ' ' : '0' + (ch / 10) % 10);
+	printf("\n");
+	for (int ch=0;ch<SCAN_CHANNELS;ch++) printf("%c", '0' + ch % 10);
+	printf("\n");
+	printf("%s\n", line);
+}
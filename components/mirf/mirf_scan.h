@@ -0,0 +1,20 @@
+#ifndef MAIN_MIRF_SCAN_H_
+#define MAIN_MIRF_SCAN_H_
+
+#include "mirf.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define SCAN_CHANNELS 126
+#define SCAN_MIN_DWELL 170 // 130us RX settling + 40us for RPD
+
+esp_err_t Nrf24_scan(NRF24_t * dev, const uint8_t * channels, size_t count, int dwell, int repeats, uint16_t * histogram);
+void      Nrf24_printScan(const uint16_t * histogram, int repeats);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* MAIN_MIRF_SCAN_H_ */
@@ -0,0 +1,108 @@
+#include <string.h>
+#include <stdlib.h>
+
+#include "freertos/FreeRTOS.h"
+
+#include "mirf_stats.h"
+
+// Allocates a table for up to links destination addresses
+esp_err_t Nrf24_statsInit(NRF24_stats_t * stats, size_t links)
+{
+	memset(stats, 0, sizeof(NRF24_stats_t));
+	if (links == 0) return ESP_ERR_INVALID_ARG;
+	stats->links = calloc(links, sizeof(rf24_link_stats_t));
+	if (stats->links == NULL) return ESP_ERR_NO_MEM;
+	stats->count = links;
+	portMUX_INITIALIZE(&stats->mux);
+	return ESP_OK;
+}
+
+void Nrf24_statsDeinit(NRF24_stats_t * stats)
+{
+	free(stats->links);
+	memset(stats, 0, sizeof(NRF24_stats_t));
+}
+
+// Records the outcome of every packet dev sends: Nrf24_isSend(), Nrf24_isSending(),
+// Nrf24_sendStream() and Nrf24_sendAsync(). NULL turns it off.
+// Costs one OBSERVE_TX read per packet, except for streamed packets.
+void Nrf24_setStats(NRF24_t * dev, NRF24_stats_t * stats)
+{
+	dev->stats = stats;
+}
+
+// Must be called inside the critical section
+static rf24_link_stats_t * stats_find(NRF24_stats_t * stats, const uint8_t * addr, uint8_t width, bool create)
+{
+	for (size_t i=0;i<stats->used;i++) {
+		rf24_link_stats_t * link = &stats->links[i];
+		if (link->width == width && memcmp(link->addr, addr, width) == 0) return link;
+	}
+	if (!create || stats->used == stats->count) return NULL;
+	rf24_link_stats_t * link = &stats->links[stats->used++];
+	memset(link, 0, sizeof(rf24_link_stats_t));
+	memcpy(link->addr, addr, width);
+	link->width = width;
+	link->latencyMin = UINT32_MAX;
+	return link;
+}
+
+// Adds one packet to the statistics of addr.
+// retries is ARC_CNT, or -1 when unknown. latency is in us, or -1 when unknown.
+void Nrf24_statsRecord(NRF24_stats_t * stats, const uint8_t * addr, uint8_t width, rf24_tx_result_e result, int retries, int64_t latency, bool plosWrap)
+{
+	portENTER_CRITICAL(&stats->mux);
+	rf24_link_stats_t * link = stats_find(stats, addr, width, true);
+	if (link == NULL) {
+		stats->overflow++;
+		portEXIT_CRITICAL(&stats->mux);
+		return;
+	}
+	link->attempts++;
+	if (result == RF24_TX_ACKED) {
+		link->acked++;
+		if (retries >= 0 && retries < 16) link->retries[retries]++;
+	} else if (result == RF24_TX_MAX_RT) {
+		link->maxRt++;
+	} else {
+		link->timeouts++;
+	}
+	if (plosWrap) link->plosWraps++;
+	if (latency >= 0 && result == RF24_TX_ACKED) {
+		uint32_t us = (latency > UINT32_MAX) ? UINT32_MAX : (uint32_t)latency;
+		link->latencyCount++;
+		link->latencySum += us;
+		if (us < link->latencyMin) link->latencyMin = us;
+		if (us > link->latencyMax) link->latencyMax = us;
+	}
+	portEXIT_CRITICAL(&stats->mux);
+}
+
+// Copies the statistics of addr (width bytes, as passed to Nrf24_statsRecord()) to link.
+// Returns false when nothing was sent to addr.
+bool Nrf24_statsSnapshot(NRF24_stats_t * stats, const uint8_t * addr, uint8_t width, rf24_link_stats_t * link)
+{
+	portENTER_CRITICAL(&stats->mux);
+	rf24_link_stats_t * found = stats_find(stats, addr, width, false);
+	if (found) *link = *found;
+	portEXIT_CRITICAL(&stats->mux);
+	return found != NULL;
+}
+
+// Copies the statistics of up to max addresses to links. Returns the number copied.
+size_t Nrf24_statsSnapshotAll(NRF24_stats_t * stats, rf24_link_stats_t * links, size_t max)
+{
+	portENTER_CRITICAL(&stats->mux);
+	size_t count = (stats->used < max) ? stats->used : max;
+	memcpy(links, stats->links, count * sizeof(rf24_link_stats_t));
+	portEXIT_CRITICAL(&stats->mux);
+	return count;
+}
+
+void Nrf24_statsReset(NRF24_stats_t * stats)
+{
+	portENTER_CRITICAL(&stats->mux);
+	stats->used = 0;
+	stats->overflow = 0;
+	portEXIT_CRITICAL(&stats->mux);
+}
@@ -0,0 +1,49 @@
+#ifndef MAIN_MIRF_STATS_H_
+#define MAIN_MIRF_STATS_H_
+
+#include "freertos/FreeRTOS.h"
+#include "mirf.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * Send statistics of one destination address.
+ */
+typedef struct {
+    uint8_t addr[mirf_ADDR_LEN];
+    uint8_t width;// Address width in bytes.
+    uint32_t attempts;// Packets sent.
+    uint32_t acked;// Packets that got TX_DS.
+    uint32_t maxRt;// Packets that reached MAX_RT.
+    uint32_t timeouts;// Packets with neither TX_DS nor MAX_RT in time.
+    uint32_t retries[16];// ARC_CNT of each acknowledged packet.
+    uint32_t plosWraps;// Times PLOS_CNT reached 15 and was restarted.
+    uint32_t latencyCount;// Packets with a measured latency.
+    uint64_t latencySum;// us
+    uint32_t latencyMin;// us
+    uint32_t latencyMax;// us
+} rf24_link_stats_t;
+
+typedef struct NRF24_stats_s {
+    rf24_link_stats_t * links;
+    size_t count;// Table size.
+    size_t used;
+    uint32_t overflow;// Sends to addresses that did not fit into the table.
+    portMUX_TYPE mux;
+} NRF24_stats_t;
+
+esp_err_t Nrf24_statsInit(NRF24_stats_t * stats, size_t links);
+void      Nrf24_statsDeinit(NRF24_stats_t * stats);
+void      Nrf24_setStats(NRF24_t * dev, NRF24_stats_t * stats);
+void      Nrf24_statsRecord(NRF24_stats_t * stats, const uint8_t * addr, uint8_t width, rf24_tx_result_e result, int retries, int64_t latency, bool plosWrap);
+bool      Nrf24_statsSnapshot(NRF24_stats_t * stats, const uint8_t * addr, uint8_t width, rf24_link_stats_t * link);
+size_t    Nrf24_statsSnapshotAll(NRF24_stats_t * stats, rf24_link_stats_t * links, size_t max);
+void      Nrf24_statsReset(NRF24_stats_t * stats);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* MAIN_MIRF_STATS_H_ */